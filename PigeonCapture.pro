@@ -26,6 +26,7 @@ INCLUDEPATH += gif/ \
 
 SOURCES += \
     capture/areaselector.cpp \
+    capture/framerecorder.cpp \
     gif/avilib.cpp \
     gif/gif.cpp \
     main.cpp \
@@ -36,8 +37,11 @@ SOURCES += \
 HEADERS += \
     gif/avilib.h \
     picture_browser/ASCII_Art.h \
+    picture_browser/framepipeline.h \
     capture/areaselector.h \
+    capture/framerecorder.h \
     gif/gif.h \
+    gif/gifdecoder.h \
     capture/mainwindow.h \
     picture_browser/picturebrowser.h \
     picture_browser/resizablepicture.h \
@@ -0,0 +1,306 @@
+#include "framerecorder.h"
+
+FrameRecorder::FrameRecorder(int maxQueue) : maxQueue(qMax(1, maxQueue))
+{
+    pool.setMaxThreadCount(1);
+}
+
+FrameRecorder::~FrameRecorder()
+{
+    // 后台线程会调用子类的虚函数，所以子类析构时就要 stop 并 waitForFinished
+}
+
+bool FrameRecorder::start(QString path)
+{
+    QMutexLocker locker(&mutex);
+    if (running)
+        return false;
+    this->path = path;
+    running = true;
+    future = QtConcurrent::run(&pool, [=]{ run(); });
+    return true;
+}
+
+/**
+ * 添加一帧，立即返回
+ * 写入跟不上时替换掉最后排队的一帧
+ */
+void FrameRecorder::addFrame(const QImage &image, qint64 timestamp)
+{
+    QMutexLocker locker(&mutex);
+    if (!running || stopping || failed || image.isNull())
+        return;
+
+    if (queue.size() >= maxQueue)
+    {
+        queue.last() = Frame{image, timestamp};
+        dropped++;
+    }
+    else
+    {
+        queue.enqueue(Frame{image, timestamp});
+    }
+    condition.wakeOne();
+}
+
+/**
+ * 停止录制，队列中剩下的帧写完后关闭文件
+ * timestamp 是最后一帧结束的时间
+ */
+void FrameRecorder::stop(qint64 timestamp)
+{
+    QMutexLocker locker(&mutex);
+    if (!running || stopping)
+        return;
+    stopping = true;
+    endTime = timestamp;
+    condition.wakeOne();
+}
+
+void FrameRecorder::waitForFinished()
+{
+    future.waitForFinished();
+}
+
+bool FrameRecorder::isFailed() const
+{
+    QMutexLocker locker(&mutex);
+    return failed;
+}
+
+int FrameRecorder::writtenCount() const
+{
+    QMutexLocker locker(&mutex);
+    return written;
+}
+
+int FrameRecorder::droppedCount() const
+{
+    QMutexLocker locker(&mutex);
+    return dropped;
+}
+
+void FrameRecorder::run()
+{
+    bool opened = false;
+    forever
+    {
+        QMutexLocker locker(&mutex);
+        while (queue.isEmpty() && !stopping)
+            condition.wait(&mutex);
+        if (queue.isEmpty()) // 停止了，而且都写完了
+            break;
+        Frame frame = queue.dequeue();
+        locker.unlock();
+
+        if (!opened)
+        {
+            opened = openFile(path, frame.image.size());
+            if (!opened)
+            {
+                qDebug() << "录制失败，无法打开文件：" << path;
+                locker.relock();
+                failed = true;
+                queue.clear();
+                break;
+            }
+        }
+
+        bool ok = writeFrame(frame.image, frame.time);
+        locker.relock();
+        if (!ok)
+        {
+            qDebug() << "录制失败，无法写入文件：" << path;
+            failed = true;
+            queue.clear();
+            break;
+        }
+        written++;
+    }
+
+    if (opened)
+        closeFile(endTime);
+}
+
+GifRecorder::GifRecorder(int maxQueue) : FrameRecorder(maxQueue)
+{
+    QSettings settings;
+    dither = gifDitherSetting(settings);
+    lookupMode = static_cast<Gif_H::GifLookupMode>(settings.value("gif/paletteLookup", Gif_H::GifLookupCache).toInt());
+    quantizer = static_cast<Gif_H::GifQuantizer>(settings.value("gif/quantizer", Gif_H::GifQuantizeMedianSplit).toInt());
+    mergeDuplicates = settings.value("gif/mergeDuplicates", true).toBool();
+    duplicateThreshold = settings.value("gif/duplicateThreshold", 0).toUInt();
+    adaptiveBitDepth = settings.value("gif/adaptiveBitDepth", true).toBool();
+    maxColorError = settings.value("gif/maxColorError", 0).toInt();
+}
+
+GifRecorder::~GifRecorder()
+{
+    stop(0); // 没有停止过就以最后一帧结束
+    waitForFinished();
+}
+
+bool GifRecorder::openFile(const QString &path, QSize size)
+{
+    this->size = size;
+    // 每帧的延时要等下一帧来了才知道，先写0，之后再改
+    if (!gif.GifBegin(&writer, path.toLocal8Bit().data(), static_cast<uint32_t>(size.width()),
+                      static_cast<uint32_t>(size.height()), 1, 8, dither, nullptr, gifChannelOrder()))
+        return false;
+    writer.lookupMode = lookupMode;
+    writer.quantizer = quantizer;
+    writer.numThreads = QThread::idealThreadCount(); // 大图分给 writer 的一组线程，每帧复用
+    writer.mergeDuplicates = mergeDuplicates;
+    writer.duplicateThreshold = duplicateThreshold;
+    writer.adaptiveBitDepth = adaptiveBitDepth;
+    writer.maxColorError = maxColorError;
+    return true;
+}
+
+bool GifRecorder::writeFrame(const QImage &image, qint64 timestamp)
+{
+    QImage frame = image;
+    if (frame.size() != size) // 录制中窗口大小变了
+        frame = frame.scaled(size);
+    frame = toGifFrameFormat(frame); // 截图是 RGB32，一般不用转换
+
+    // 上一帧一直显示到这一帧开始（包括中间丢掉的帧）
+    if (hasFrame)
+        extendLastFrame(timestamp);
+    else
+        startTime = timestamp;
+    hasFrame = true;
+
+    // 和上一帧相同时不写入，时长继续累加到上一帧
+    if (!gif.GifWriteFrame(&writer, frame.constBits(), static_cast<uint32_t>(size.width()), static_cast<uint32_t>(size.height()),
+                      0, 8, dither, static_cast<uint32_t>(frame.bytesPerLine())))
+        return false;
+    return !ferror(writer.f); // 磁盘满等写入错误
+}
+
+void GifRecorder::closeFile(qint64 timestamp)
+{
+    if (hasFrame)
+        extendLastFrame(qMax(timestamp, startTime + writtenTime * 10 + 10));
+    gif.GifEnd(&writer);
+    qDebug() << "GIF录制完毕，帧数：" << writtenCount() << " 丢帧：" << droppedCount()
+             << " 临时内存堆分配：" << gif.GifHeapAllocs(&writer);
+}
+
+/**
+ * 按时间戳设置上一帧的延时
+ * 用累计时间计算，避免每帧取整的误差越积越多
+ */
+void GifRecorder::extendLastFrame(qint64 timestamp)
+{
+    qint64 total = (timestamp - startTime) / 10;
+    qint64 delta = total - writtenTime;
+    if (delta <= 0)
+        return;
+    delta = qMin(delta, static_cast<qint64>(0xffff - writer.lastDelay)); // 最长655秒
+    gif.GifExtendDelay(&writer, static_cast<uint32_t>(delta));
+    writtenTime = total;
+}
+
+AviRecorder::AviRecorder(int interval, int maxQueue) : FrameRecorder(maxQueue), interval(qMax(1, interval))
+{
+}
+
+AviRecorder::~AviRecorder()
+{
+    stop(0);
+    waitForFinished();
+}
+
+bool AviRecorder::openFile(const QString &path, QSize size)
+{
+    this->size = size;
+    avi = AVI_open_output_file(path.toLocal8Bit().data());
+    if (!avi)
+    {
+        qDebug() << "打开AVI失败：" << AVI_strerror();
+        return false;
+    }
+    AVI_set_video(avi, size.width(), size.height(), 1000.0 / interval, "mjpg");
+    AVI_set_output_buffer(avi, 4 << 20); // 攒够4M才写一次文件
+
+    // 每行：这张截图在AVI中的帧序号、截图时间（毫秒时间戳）
+    QFileInfo info(path);
+    timestampFile.setFileName(info.dir().absoluteFilePath(info.completeBaseName() + ".timestamps"));
+    if (timestampFile.open(QIODevice::WriteOnly | QIODevice::Text))
+        timestampStream.setDevice(&timestampFile);
+    else
+        qDebug() << "无法保存截图时间：" << timestampFile.fileName();
+    return true;
+}
+
+bool AviRecorder::writeFrame(const QImage &image, qint64 timestamp)
+{
+    if (writeFailed)
+        return false;
+
+    // 截图间隔比设定的长（卡顿、丢帧），用上一帧补齐
+    if (hasFrame)
+        fillFrames(timestamp);
+    else
+        startTime = timestamp;
+    hasFrame = true;
+    if (writeFailed)
+        return false;
+
+    QImage frame = image;
+    if (frame.size() != size) // 录制中窗口大小变了
+        frame = frame.scaled(size);
+    QByteArray ba;
+    QBuffer bf(&ba);
+    if (!frame.save(&bf, "jpg", -1))
+    {
+        qDebug() << "保存图片Buffer失败";
+        return true; // 只是跳过这一帧，由下一帧补齐
+    }
+    if (AVI_write_frame(avi, ba.data(), ba.size(), 1) != 0)
+    {
+        qDebug() << "写入AVI失败：" << AVI_strerror();
+        writeFailed = true;
+        return false;
+    }
+    if (timestampStream.device())
+        timestampStream << aviFrames << '\t' << timestamp << '\n';
+    aviFrames++;
+    return true;
+}
+
+void AviRecorder::closeFile(qint64 timestamp)
+{
+    if (hasFrame && !writeFailed)
+        fillFrames(timestamp);
+    if (AVI_close(avi) != 0)
+        qDebug() << "关闭AVI失败：" << AVI_strerror();
+    avi = nullptr;
+    if (timestampStream.device())
+    {
+        timestampStream.flush();
+        timestampStream.setDevice(nullptr);
+    }
+    timestampFile.close();
+    qDebug() << "AVI录制完毕，帧数：" << writtenCount() << " 补齐的重复帧：" << dupFrames << " 丢帧：" << droppedCount();
+}
+
+/**
+ * 按时间戳应有的帧数，重复上一帧补齐
+ * 只补到 timestamp 之前的帧，用累计时间计算，不会越差越多
+ */
+void AviRecorder::fillFrames(qint64 timestamp)
+{
+    const qint64 expected = (timestamp - startTime) / interval;
+    while (aviFrames < expected)
+    {
+        if (AVI_dup_frame(avi) != 0)
+        {
+            writeFailed = true;
+            return;
+        }
+        aviFrames++;
+        dupFrames++;
+    }
+}
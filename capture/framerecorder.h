@@ -0,0 +1,140 @@
+#ifndef FRAMERECORDER_H
+#define FRAMERECORDER_H
+
+#include <QImage>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QFuture>
+#include <QThreadPool>
+#include <QtConcurrent/QtConcurrent>
+#include <QSettings>
+#include <QDebug>
+#include <QBuffer>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QTextStream>
+#include "gif.h"
+#include "avilib.h"
+#include "framepipeline.h"
+
+/**
+ * 边截图边写入文件的录制器
+ * 截图时 addFrame 只把帧放进队列，由后台线程依次写入，停止后很快就能得到完整的文件
+ * 写入跟不上时，队列满了就用新的一帧替换最后排队的那帧（丢帧），
+ * 每帧的时长按相邻两帧的时间戳计算，丢掉的时间自然算到上一帧里
+ */
+class FrameRecorder
+{
+public:
+    FrameRecorder(int maxQueue);
+    virtual ~FrameRecorder();
+
+    bool start(QString path);
+    void addFrame(const QImage& image, qint64 timestamp);
+    void stop(qint64 timestamp);
+    void waitForFinished();
+
+    bool isFailed() const;
+    int writtenCount() const;
+    int droppedCount() const;
+
+protected:
+    // 以下在后台线程中调用；打开文件时才知道第一帧的大小
+    // 返回 false 表示文件无法继续写入，之后的帧都不再处理
+    virtual bool openFile(const QString& path, QSize size) = 0;
+    virtual bool writeFrame(const QImage& image, qint64 timestamp) = 0;
+    virtual void closeFile(qint64 timestamp) = 0;
+
+private:
+    void run();
+
+    struct Frame
+    {
+        QImage image;
+        qint64 time;
+    };
+
+    QString path;
+    int maxQueue;
+    mutable QMutex mutex;
+    QWaitCondition condition;
+    QQueue<Frame> queue;
+    bool running = false;
+    bool stopping = false;
+    bool failed = false;
+    qint64 endTime = 0;
+    int written = 0;
+    int dropped = 0;
+    QThreadPool pool; // 独占一个线程，不和生成GIF等任务抢全局线程池
+    QFuture<void> future;
+};
+
+/**
+ * 连续截图直接录制为GIF，不经过JPG编码和解码
+ * 参数和生成GIF时一样，从 gif/ 设置中读取（不支持全局调色板，录制时还没有后面的帧）
+ */
+class GifRecorder : public FrameRecorder
+{
+public:
+    GifRecorder(int maxQueue = 4);
+    ~GifRecorder() override;
+
+protected:
+    bool openFile(const QString& path, QSize size) override;
+    bool writeFrame(const QImage& image, qint64 timestamp) override;
+    void closeFile(qint64 timestamp) override;
+
+private:
+    void extendLastFrame(qint64 timestamp);
+
+    Gif_H gif;
+    Gif_H::GifWriter writer;
+    QSize size;
+    int dither;
+    Gif_H::GifLookupMode lookupMode;
+    Gif_H::GifQuantizer quantizer;
+    bool mergeDuplicates;
+    uint32_t duplicateThreshold;
+    bool adaptiveBitDepth;
+    int maxColorError;
+
+    bool hasFrame = false;
+    qint64 startTime = 0;
+    qint64 writtenTime = 0; // 已经写入的总时长，单位：10毫秒
+};
+
+/**
+ * 连续截图直接录制为 MJPEG 的AVI，整段只有一个文件，不会产生成千上万张小图片
+ * 索引由 avilib 保存在内存中，关闭时写入；超过1G自动分段（OpenDML）
+ * AVI是固定帧率，截图时间不均匀时用重复帧补齐，真实的截图时间另外写入同名的 .timestamps 文件
+ */
+class AviRecorder : public FrameRecorder
+{
+public:
+    AviRecorder(int interval, int maxQueue = 4);
+    ~AviRecorder() override;
+
+protected:
+    bool openFile(const QString& path, QSize size) override;
+    bool writeFrame(const QImage& image, qint64 timestamp) override;
+    void closeFile(qint64 timestamp) override;
+
+private:
+    void fillFrames(qint64 timestamp);
+
+    int interval;
+    avi_t* avi = nullptr;
+    QSize size;
+    QFile timestampFile;
+    QTextStream timestampStream;
+
+    bool hasFrame = false;
+    bool writeFailed = false;
+    qint64 startTime = 0;
+    long aviFrames = 0;
+    int dupFrames = 0;
+};
+
+#endif // FRAMERECORDER_H
@@ -64,6 +64,19 @@ MainWindow::MainWindow(QWidget *parent)
         serialCapture();
     });
 
+    // 连续截图的保存格式
+    QActionGroup* serialFormatGroup = new QActionGroup(this);
+    serialFormatGroup->addAction(ui->actionSerial_Save_Images);
+    serialFormatGroup->addAction(ui->actionSerial_Save_GIF);
+    serialFormatGroup->addAction(ui->actionSerial_Save_AVI);
+    serialFormat = settings.value("serial/format", SerialImages).toInt();
+    if (serialFormat == SerialGif)
+        ui->actionSerial_Save_GIF->setChecked(true);
+    else if (serialFormat == SerialAvi)
+        ui->actionSerial_Save_AVI->setChecked(true);
+    else
+        ui->actionSerial_Save_Images->setChecked(true);
+
     bool recordAudio = settings.value("serial/audio", false).toBool();
     ui->recordAudioCheckBox->setChecked(recordAudio);
 
@@ -239,6 +252,27 @@ void MainWindow::runCapture()
 
 void MainWindow::serialCapture()
 {
+    if (frameRecorder) // 直接录制，交给后台线程编码
+    {
+        // 打开或写入文件失败后，后台线程不再处理任何帧，停止录制并提示
+        if (frameRecorder->isFailed())
+        {
+            triggerSerialCapture();
+            QMessageBox::warning(this, "录制失败", "无法写入文件，已停止连续截图，请检查保存位置：\n" + saveDir);
+            return;
+        }
+
+        try {
+            frameRecorder->addFrame(getScreenShot().toImage(), getTimestamp());
+        } catch (...) {
+            qDebug() << "截图失败，可能是内存不足";
+        }
+
+        serialCaptureCount++;
+        ui->serialCaptureShortcut->setText("已截" + QString::number(serialCaptureCount) + "张");
+        return;
+    }
+
     QString fileName = timeToFile() + "." + saveMode;
     QDir dir(saveDir);
     dir = QDir(dir.filePath(serialCaptureDir));
@@ -272,25 +306,46 @@ void MainWindow::triggerSerialCapture()
         tipTimer->start();
         qDebug() << "停止连续截图";
 
-        ui->selectDirButton->setEnabled(true);
-
-        if (!prevTimer)
+        if (frameRecorder) // 剩下的帧在后台写完
         {
-            endRecordAudio();
+            FrameRecorder* recorder = frameRecorder;
+            frameRecorder = nullptr;
+            recorder->stop(getTimestamp());
+            QtConcurrent::run([=]{
+                recorder->waitForFinished();
+                delete recorder;
+            });
         }
+
+        ui->selectDirButton->setEnabled(true);
+
+        endRecordAudio();
     }
     else // 开启
     {
         serialCaptureDir = "连"+timeToFile();
-        QDir(saveDir).mkdir(serialCaptureDir);
-        QDir currentDir = QDir(saveDir).absoluteFilePath(serialCaptureDir);
-
-        // 保存录制参数
-        QSettings params(currentDir.absoluteFilePath(SEQUENCE_PARAM_FILE), QSettings::IniFormat);
-        params.setValue("gif/interval", prevTimer->interval());
-        params.setValue("time/start", serialStartTime);
-        params.setValue("time/end", serialEndTime);
-        params.sync();
+        if (serialFormat == SerialGif) // 不保存图片，直接录制为同名的GIF
+        {
+            frameRecorder = new GifRecorder;
+            frameRecorder->start(QDir(saveDir).absoluteFilePath(serialCaptureDir + ".gif"));
+        }
+        else if (serialFormat == SerialAvi) // 所有帧写入同一个AVI，截图时间在同名的 .timestamps 中
+        {
+            frameRecorder = new AviRecorder(serialTimer->interval());
+            frameRecorder->start(QDir(saveDir).absoluteFilePath(serialCaptureDir + ".avi"));
+        }
+        else
+        {
+            QDir(saveDir).mkdir(serialCaptureDir);
+            QDir currentDir = QDir(saveDir).absoluteFilePath(serialCaptureDir);
+
+            // 保存录制参数
+            QSettings params(currentDir.absoluteFilePath(SEQUENCE_PARAM_FILE), QSettings::IniFormat);
+            params.setValue("gif/interval", prevTimer->interval());
+            params.setValue("time/start", serialStartTime);
+            params.setValue("time/end", serialEndTime);
+            params.sync();
+        }
 
         serialCaptureCount = 0;
         // 开始连续截图
@@ -314,7 +369,6 @@ void MainWindow::startPrevCapture()
         clearPrevCapture();
     }
 
-    startRecordAudio();
     prevTimer->start();
     prevCapturedList = new QList<CaptureInfo>();
 }
@@ -399,23 +453,27 @@ void MainWindow::areaSelectorMoved()
     showPreview(getScreenShot());
 }
 
+/**
+ * 连续截图时录制音频（录音设备是“立体声混音”，录下电脑里的声音）
+ * 保存为图片目录中的 audio.wav，开始录制的时间写入 params.ini 的 audio/start，
+ * 和图片文件名用的是同一个时钟，生成AVI时按它对齐；直接录制为GIF/AVI时，保存为同名的 .wav
+ */
 void MainWindow::startRecordAudio()
 {
-    if (!ui->recordAudioCheckBox->isChecked())
+    if (!ui->recordAudioCheckBox->isChecked() || audioInput)
+        return ;
+    if (!serialTimer->isActive()) // 预先截图要保存时才有目录，不录制
         return ;
 
-    audioFile.setFileName("test.raw");
-    audioFile.open(QIODevice::WriteOnly | QIODevice::Truncate);
     QAudioFormat format;
-
     format.setSampleRate(48000);
     format.setChannelCount(2);
     format.setSampleSize(16);
     format.setCodec("audio/pcm");
     format.setByteOrder(QAudioFormat::LittleEndian);
-    format.setSampleType(QAudioFormat::UnSignedInt);
+    format.setSampleType(QAudioFormat::SignedInt); // WAV 中16位的PCM是有符号数
 
-    QAudioDeviceInfo info = QAudioDeviceInfo::defaultOutputDevice();
+    QAudioDeviceInfo info = QAudioDeviceInfo::defaultInputDevice();
     if (info.isNull())
     {
         ui->recordAudioCheckBox->setChecked(false);
@@ -423,41 +481,65 @@ void MainWindow::startRecordAudio()
         on_actionAudio_Recorder_Settings_triggered();
         return ;
     }
-    qDebug() << "input devices:";
-    auto inputs = QAudioDeviceInfo::availableDevices(QAudio::AudioInput);
-    foreach (auto in, inputs)
-        qDebug() << in.deviceName();
-    qDebug() << "output devices:";
-    auto outputs = QAudioDeviceInfo::availableDevices(QAudio::AudioOutput);
-    foreach (auto out, outputs)
-        qDebug() << out.deviceName();
-//    info = inputs.at(0);
     qDebug() << "录制设备：" << info.deviceName();
     if (!info.isFormatSupported(format))
     {
        qWarning() << "default format not supported try to use nearest";
        format = info.nearestFormat(format);
     }
+    // WAV 只能保存小端的整数PCM：8位是无符号数，更多位是有符号数
+    if (format.codec() != "audio/pcm" || format.byteOrder() != QAudioFormat::LittleEndian
+            || format.sampleSize() < 8 || format.sampleSize() % 8
+            || format.sampleType() != (format.sampleSize() == 8 ? QAudioFormat::UnSignedInt : QAudioFormat::SignedInt))
+    {
+        qWarning() << "录音设备不支持保存为WAV的格式：" << format;
+        return ;
+    }
+
+    const bool inSequence = serialFormat == SerialImages;
+    QDir dir(saveDir);
+    QDir sequenceDir(dir.absoluteFilePath(serialCaptureDir));
+    QString wavPath = inSequence ? sequenceDir.absoluteFilePath("audio.wav") : dir.absoluteFilePath(serialCaptureDir + ".wav");
+    audioFile.setFileName(wavPath);
+    if (!audioFile.open(QIODevice::WriteOnly | QIODevice::Truncate) || !writeWavHeader(audioFile, format, 0))
+    {
+        qDebug() << "无法保存音频：" << wavPath;
+        audioFile.close();
+        return ;
+    }
 
-    audioOutput = new QAudioOutput(info, format, this);
-    audioOutput->start(&audioFile);
+    audioFormat = format;
+    audioInput = new QAudioInput(info, format, this);
+    audioInput->start(&audioFile);
     audioStartTime = getTimestamp();
+
+    if (inSequence)
+    {
+        QSettings params(sequenceDir.absoluteFilePath(SEQUENCE_PARAM_FILE), QSettings::IniFormat);
+        params.setValue("audio/file", "audio.wav");
+        params.setValue("audio/start", audioStartTime);
+        params.sync();
+    }
+    qDebug() << "开始录制音频：" << wavPath;
 }
 
 void MainWindow::endRecordAudio()
 {
-    if (!audioRecorder)
+    if (!audioInput)
         return ;
 
     audioEndTime = getTimestamp();
-    audioRecorder->stop();
-    delete audioRecorder;
-    audioRecorder = nullptr;
+    audioInput->stop();
+    delete audioInput;
+    audioInput = nullptr;
+
+    // 录完才知道数据的长度，改写文件头；没改写时读取到文件末尾为止，也能用
+    const qint64 dataBytes = audioFile.size() - WAV_HEADER_BYTES;
+    if (!audioFile.seek(0) || !writeWavHeader(audioFile, audioFormat, dataBytes))
+        qDebug() << "无法写入音频文件头：" << audioFile.fileName();
     audioFile.close();
 
-//    translateRaw2Wav("test.raw", "test.wav");
-
-    qDebug() << "结束录制音频";
+    qDebug() << "结束录制音频：" << audioFile.fileName() << (audioEndTime - audioStartTime) << "ms";
 }
 
 /**
@@ -549,6 +631,17 @@ void MainWindow::closeEvent(QCloseEvent *event)
 {
     clearPrevCapture();
 
+    // 正在直接录制时关闭：等剩下的帧写完，写入文件头和索引，否则文件无法打开
+    if (frameRecorder)
+    {
+        serialTimer->stop();
+        frameRecorder->stop(getTimestamp());
+        frameRecorder->waitForFinished();
+        delete frameRecorder;
+        frameRecorder = nullptr;
+    }
+    endRecordAudio();
+
     settings.setValue("capture/area", areaSelector->geometry());
     areaSelector->deleteLater();
     settings.setValue("mainwindow/geometry", this->saveGeometry());
@@ -605,63 +698,27 @@ QString MainWindow::get_window_class(HWND hwnd) const
 }
 
 /**
- * 参考链接：https://blog.csdn.net/GoForwardToStep/article/details/52779913
+ * 写入 WAV_HEADER_BYTES 字节的WAV文件头，dataBytes 是PCM数据的长度
+ * 开始录制时还不知道长度，写0，读取时到文件末尾为止
  */
-qint64 MainWindow::translateRaw2Wav(QString rawFileName, QString wavFileName)
+bool MainWindow::writeWavHeader(QFile &file, const QAudioFormat &format, qint64 dataBytes)
 {
-    // 开始设置WAV的文件头
-    // 这里具体的数据代表什么含义请看上一篇文章（Qt之WAV文件解析）中对wav文件头的介绍
-    WAVFILEHEADER WavFileHeader;
-    qstrcpy(WavFileHeader.RiffName, "RIFF");
-    qstrcpy(WavFileHeader.WavName, "WAVE");
-    qstrcpy(WavFileHeader.FmtName, "fmt ");
-    qstrcpy(WavFileHeader.DATANAME, "data");
-
-    // 表示 FMT块 的长度
-    WavFileHeader.nFmtLength = 16;
-    // 表示 按照PCM 编码;
-    WavFileHeader.nAudioFormat = 1;
-    // 声道数目;
-    WavFileHeader.nChannleNumber = 1;
-    // 采样频率;
-    WavFileHeader.nSampleRate = 48000;
-
-    // nBytesPerSample 和 nBytesPerSecond这两个值通过设置的参数计算得到;
-    // 数据块对齐单位(每个采样需要的字节数 = 通道数 × 每次采样得到的样本数据位数 / 8 )
-    WavFileHeader.nBytesPerSample = 2;
-    // 波形数据传输速率
-    // (每秒平均字节数 = 采样频率 × 通道数 × 每次采样得到的样本数据位数 / 8  = 采样频率 × 每个采样需要的字节数 )
-    WavFileHeader.nBytesPerSecond = 96000;
-
-    // 每次采样得到的样本数据位数;
-    WavFileHeader.nBitsPerSample = 16;
-
-    QFile cacheFile(rawFileName);
-    QFile wavFile(wavFileName);
-
-    if (!cacheFile.open(QIODevice::ReadWrite))
-    {
-        return -1;
-    }
-    if (!wavFile.open(QIODevice::WriteOnly))
-    {
-        return -2;
-    }
-
-    int nSize = sizeof(WavFileHeader);
-    qint64 nFileLen = cacheFile.bytesAvailable();
-
-    WavFileHeader.nRiffLength = nFileLen - 8 + nSize;
-    WavFileHeader.nDataLength = nFileLen;
-
-    // 先将wav文件头信息写入，再将音频数据写入;
-    wavFile.write((char *)&WavFileHeader, nSize);
-    wavFile.write(cacheFile.readAll());
-
-    cacheFile.close();
-    wavFile.close();
-
-    return nFileLen;
+    const quint32 dataSize = static_cast<quint32>(qBound(qint64(0), dataBytes, qint64(0xFFFFFFFF - 36)));
+    const int blockAlign = format.channelCount() * format.sampleSize() / 8;
+    uchar head[WAV_HEADER_BYTES];
+    memcpy(head, "RIFF", 4);
+    qToLittleEndian<quint32>(dataSize ? 36 + dataSize : 0, head + 4);
+    memcpy(head + 8, "WAVEfmt ", 8);
+    qToLittleEndian<quint32>(16, head + 16); // fmt 块的长度
+    qToLittleEndian<quint16>(1, head + 20);  // PCM
+    qToLittleEndian<quint16>(static_cast<quint16>(format.channelCount()), head + 22);
+    qToLittleEndian<quint32>(static_cast<quint32>(format.sampleRate()), head + 24);
+    qToLittleEndian<quint32>(static_cast<quint32>(format.sampleRate() * blockAlign), head + 28);
+    qToLittleEndian<quint16>(static_cast<quint16>(blockAlign), head + 32);
+    qToLittleEndian<quint16>(static_cast<quint16>(format.sampleSize()), head + 34);
+    memcpy(head + 36, "data", 4);
+    qToLittleEndian<quint32>(dataSize, head + 40);
+    return file.write(reinterpret_cast<const char*>(head), WAV_HEADER_BYTES) == WAV_HEADER_BYTES;
 }
 
 void MainWindow::on_modeTab_currentChanged(int index)
@@ -858,11 +915,29 @@ void MainWindow::on_selectScreenWindow_clicked()
     areaSelector->setArea(rect);
 }
 
+void MainWindow::on_actionSerial_Save_Images_triggered()
+{
+    serialFormat = SerialImages;
+    settings.setValue("serial/format", serialFormat);
+}
+
+void MainWindow::on_actionSerial_Save_GIF_triggered()
+{
+    serialFormat = SerialGif;
+    settings.setValue("serial/format", serialFormat);
+}
+
+void MainWindow::on_actionSerial_Save_AVI_triggered()
+{
+    serialFormat = SerialAvi;
+    settings.setValue("serial/format", serialFormat);
+}
+
 void MainWindow::on_recordAudioCheckBox_clicked(bool checked)
 {
     settings.setValue("serial/audio", checked);
 
-    if (checked && (prevTimer->isActive() || serialTimer->isActive()))
+    if (checked && serialTimer->isActive())
     {
         startRecordAudio();
     }
@@ -880,17 +955,15 @@ void MainWindow::on_actionAudio_Recorder_Settings_triggered()
 
 void MainWindow::on_actionPlay_Test_Audio_triggered()
 {
-    sourceFile.setFileName("test.raw");
-    sourceFile.open(QIODevice::ReadOnly);
+    // 播放最近一次录制的音频
+    if (audioInput || audioFile.fileName().isEmpty())
+        return;
+    sourceFile.close();
+    sourceFile.setFileName(audioFile.fileName());
+    if (!sourceFile.open(QIODevice::ReadOnly) || !sourceFile.seek(WAV_HEADER_BYTES))
+        return;
 
-    QAudioFormat format;
-    // Set up the format, eg.
-    format.setSampleRate(48000);
-    format.setChannelCount(2);
-    format.setSampleSize(16);
-    format.setCodec("audio/pcm");
-    format.setByteOrder(QAudioFormat::LittleEndian);
-    format.setSampleType(QAudioFormat::UnSignedInt);
+    QAudioFormat format = audioFormat;
 
     QAudioDeviceInfo info(QAudioDeviceInfo::defaultOutputDevice());
     if (!info.isFormatSupported(format)) {
@@ -19,12 +19,17 @@
 #include <QAudioInput>
 #include <QAudioOutput>
 #include <QAudioRecorder>
+#include <QtEndian>
 #include <QInputDialog>
+#include <QActionGroup>
 #include "qxtglobalshortcut.h"
 #include "areaselector.h"
 #include "picturebrowser.h"
 #include "windowshwnd.h"
 #include "windowselector.h"
+#include "framerecorder.h"
+
+#define WAV_HEADER_BYTES 44
 
 QT_BEGIN_NAMESPACE
 namespace Ui { class MainWindow; }
@@ -45,37 +50,19 @@ public:
         OneWindow
     };
 
+    enum SerialFormat
+    {
+        SerialImages, // 每帧一张图片
+        SerialGif,    // 直接录制为GIF
+        SerialAvi     // 直接录制为AVI
+    };
+
     struct CaptureInfo
     {
         qint64 time;
         QString name;
         QPixmap* pixmap;
     };
-    struct WAVFILEHEADER
-    {
-        // RIFF 头
-        char RiffName[4];
-        unsigned long nRiffLength;
-
-        // 数据类型标识符
-        char WavName[4];
-
-        // 格式块中的块头
-        char FmtName[4];
-        unsigned long nFmtLength;
-
-        // 格式块中的块数据
-        unsigned short nAudioFormat;
-        unsigned short nChannleNumber;
-        unsigned long nSampleRate;
-        unsigned long nBytesPerSecond;
-        unsigned short nBytesPerSample;
-        unsigned short nBitsPerSample;
-
-        // 数据块中的块头
-        char    DATANAME[4];
-        unsigned long   nDataLength;
-    };
 
     void selectArea();
 
@@ -162,6 +149,12 @@ private slots:
 
     void on_screensCombo_currentIndexChanged(int);
 
+    void on_actionSerial_Save_Images_triggered();
+
+    void on_actionSerial_Save_GIF_triggered();
+
+    void on_actionSerial_Save_AVI_triggered();
+
 protected:
     void showEvent(QShowEvent* event);
     void closeEvent(QCloseEvent* event);
@@ -172,7 +165,7 @@ protected:
 
     QString get_window_title(HWND hwnd) const;
     QString get_window_class(HWND hwnd) const;
-    qint64 translateRaw2Wav(QString rawFileName, QString wavFileName);
+    static bool writeWavHeader(QFile& file, const QAudioFormat& format, qint64 dataBytes);
 
 private:
     Ui::MainWindow *ui;
@@ -189,9 +182,12 @@ private:
     int serialCaptureCount = 0;
     qint64 serialStartTime = 0;
     qint64 serialEndTime = 0;
+    int serialFormat = SerialImages;
+    FrameRecorder* frameRecorder = nullptr; // 直接录制为文件时，连续截图交给它
 
-    QFile audioFile;
-    QAudioRecorder* audioRecorder = nullptr;
+    QFile audioFile;            // 连续截图时录制的WAV，和图片在同一目录
+    QAudioInput* audioInput = nullptr;
+    QAudioFormat audioFormat;
     qint64 audioStartTime = 0; // 音频录制与连续截图不一定一起，可能是后续想起来再开
     qint64 audioEndTime = 0;
 
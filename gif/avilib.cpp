@@ -28,7 +28,8 @@
 //SLM
 #ifdef WIN32
 #include <io.h>
-#define ftruncate _chsize
+#define ftruncate(fd,len) (_chsize_s(fd,len) ? -1 : 0)
+#define lseek _lseeki64
 #define strncasecmp _strnicmp
 typedef int asize_t;
 #endif
@@ -37,6 +38,10 @@ typedef int asize_t;
 #include <unistd.h>
 #endif
 
+#ifndef WIN32
+#include <sys/uio.h>
+#endif
+
 #include "avilib.h"
 //#include <time.h>
 
@@ -97,6 +102,32 @@ static size_t avi_write (int fd, char *buf, size_t len)
 
 #define AVI_MAX_LEN (UINT_MAX-(1<<20)*16-HEADERBYTES)
 
+/* OpenDML: when a RIFF grows past NEW_RIFF_THRES, it is finished and
+   the file goes on in a new RIFF-AVIX. Every RIFF gets a standard index
+   (ix##) per stream, the header a super index (indx) pointing to them,
+   with room for NR_IXNN_CHUNKS entries, i.e. RIFFs */
+
+#ifndef NEW_RIFF_THRES
+#define NEW_RIFF_THRES (1024*1024*1024)
+#endif
+
+#define NR_IXNN_CHUNKS 256
+
+/* AVI_set_output_hint never reserves more than AVI_MAX_RESERVE bytes of
+   disk space, the hint is only an estimate and without native fallocate
+   support glibc reserves the space by writing every block */
+
+#ifndef AVI_MAX_RESERVE
+#define AVI_MAX_RESERVE (256*1024*1024)
+#endif
+
+#define ODML_INDX_BYTES (8+24+16*NR_IXNN_CHUNKS)
+
+#define AVI_HEADER_MAX (HEADERBYTES+(AVI_MAX_TRACKS+1)*ODML_INDX_BYTES)
+
+#define AVI_INDEX_OF_INDEXES 0x00
+#define AVI_INDEX_OF_CHUNKS  0x01
+
 #define PAD_EVEN(x) ( ((x)+1) & ~1 )
 
 
@@ -123,6 +154,20 @@ static unsigned long str2ushort(unsigned char *str)
    return ( str[0] | (str[1]<<8) );
 }
 
+/* The same for 8 byte numbers (OpenDML offsets) */
+
+static void long2str64(unsigned char *dst, avi_off_t n)
+{
+   long2str(dst,  (int)(n & 0xffffffff));
+   long2str(dst+4,(int)(n >> 32));
+}
+
+static avi_off_t str2ulong64(unsigned char *str)
+{
+   return (avi_off_t)(str2ulong(str) & 0xffffffffUL) |
+          (avi_off_t)(str2ulong(str+4) & 0xffffffffUL) << 32;
+}
+
 /* Calculate audio sample size from number of bits and number of channels.
    This may have to be adjusted for eg. 12 bits and stereo */
 
@@ -135,28 +180,130 @@ static int avi_sampsize(avi_t *AVI, int j)
    return s;
 }
 
+/* Units of the audio stream header: PCM counts blocks of one sample
+   of every channel, other formats keep the mp3 oriented values:
+   scale is Scale, SampleSize and BlockAlign, byterate is Rate and
+   AvgBytesPerSec */
+
+static void avi_audio_units(avi_t *AVI, int j, long *scale, long *byterate)
+{
+   if(AVI->track[j].a_fmt == WAVE_FORMAT_PCM && AVI->track[j].a_chans > 0)
+   {
+      *scale    = ((AVI->track[j].a_bits+7)/8)*AVI->track[j].a_chans;
+      *byterate = AVI->track[j].a_rate*(*scale);
+   }
+   else
+   {
+      *scale    = avi_sampsize(AVI, j)/4;
+      *byterate = 1000*AVI->track[j].mp3rate/8;
+   }
+}
+
+/* Write tag+length, data and the pad byte of a chunk,
+   with a single system call where writev is available */
+
+static int avi_write_chunk(int fd, unsigned char *c, unsigned char *data, int size, int length)
+{
+   static char pad = 0;
+
+#ifdef WIN32
+   if( avi_write(fd,(char *)c,8) != 8 ||
+       avi_write(fd,(char *)data,size) != (size_t)size ||
+       avi_write(fd,&pad,length-size) != (size_t)(length-size) )
+      return -1;
+#else
+   struct iovec iov[3], *v = iov;
+   int cnt = 3;
+   ssize_t n;
+
+   iov[0].iov_base = c;    iov[0].iov_len = 8;
+   iov[1].iov_base = data; iov[1].iov_len = size;
+   iov[2].iov_base = &pad; iov[2].iov_len = length-size;
+
+   while (cnt > 0) {
+      n = writev(fd, v, cnt);
+      if (n < 0)
+         return -1;
+
+      /* partial write: skip what is done and go on */
+      while (cnt > 0 && (size_t)n >= v->iov_len) {
+         n -= v->iov_len;
+         v++;
+         cnt--;
+      }
+      if (cnt > 0) {
+         v->iov_base = (char *)v->iov_base + n;
+         v->iov_len -= n;
+      }
+   }
+#endif
+   return 0;
+}
+
+/* Write out the chunks waiting in the output buffer,
+   returns -1 on write error, 0 on success */
+
+static int avi_flush(avi_t *AVI)
+{
+   long len = AVI->wbuf_len;
+
+   if(len == 0) return 0;
+
+   AVI->wbuf_len = 0;
+
+   if( avi_write(AVI->fdes,AVI->wbuf,len) != (size_t)len )
+   {
+      /* the index and the frame counts already include the buffered
+         chunks, the file cannot be finished correctly any more */
+      AVI->write_failed = 1;
+      AVI_errno = AVI_ERR_WRITE;
+      return -1;
+   }
+
+   return 0;
+}
+
 /* Add a chunk (=tag and data) to the AVI file,
    returns -1 on write error, 0 on success */
 
 static int avi_add_chunk(avi_t *AVI, unsigned char *tag, unsigned char *data, int length)
 {
    unsigned char c[8];
+   int size = length;
 
-   /* Copy tag and length int c, so that we need only 1 write system call
-      for these two values */
+   /* Copy tag and length int c, so that they go out together with the data */
 
    memcpy(c,tag,4);
    long2str(c+4,length);
 
+   length = PAD_EVEN(length);
+
+   /* With an output buffer, small chunks are only copied there;
+      a chunk bigger than the whole buffer is written directly after it */
+
+   if(AVI->wbuf)
+   {
+      if(AVI->wbuf_len + 8 + length > AVI->wbuf_size && avi_flush(AVI))
+         return -1;
+
+      if(8 + length <= AVI->wbuf_size)
+      {
+         memcpy(AVI->wbuf+AVI->wbuf_len,c,8);
+         memcpy(AVI->wbuf+AVI->wbuf_len+8,data,size);
+         if(length > size) AVI->wbuf[AVI->wbuf_len+8+size] = 0;
+         AVI->wbuf_len += 8 + length;
+         AVI->pos += 8 + length;
+         return 0;
+      }
+   }
+
    /* Output tag, length and data, restore previous position
       if the write fails */
 
-   length = PAD_EVEN(length);
-
-   if( avi_write(AVI->fdes,(char *)c,8) != 8 ||
-       avi_write(AVI->fdes,(char *)data,length) != length )
+   if( avi_write_chunk(AVI->fdes,c,data,size,length) )
    {
-      lseek(AVI->fdes,AVI->pos,SEEK_SET);
+      /* the index entry of the chunk has already been added */
+      AVI->write_failed = 1;
       AVI_errno = AVI_ERR_WRITE;
       return -1;
    }
@@ -170,7 +317,7 @@ static int avi_add_chunk(avi_t *AVI, unsigned char *tag, unsigned char *data, in
    return 0;
 }
 
-static int avi_add_index_entry(avi_t *AVI, unsigned char *tag, long flags, unsigned long pos, unsigned long len)
+static int avi_add_index_entry(avi_t *AVI, unsigned char *tag, long flags, long pos, unsigned long len)
 {
    void *ptr;
 
@@ -233,7 +380,7 @@ avi_t* AVI_open_output_file(char * filename)
 
    int mask;
    
-   unsigned char AVI_header[HEADERBYTES];
+   unsigned char AVI_header[HEADERBYTES+ODML_INDX_BYTES];
 
    /* Allocate the avi_t struct and zero it */
 
@@ -264,12 +411,16 @@ avi_t* AVI_open_output_file(char * filename)
       return 0;
    }
 
-   /* Write out HEADERBYTES bytes, the header will go here
-      when we are finished with writing */
+   /* Write out HEADERBYTES bytes and room for the super index of the
+      video stream, the header will go here when we are finished with
+      writing. avi_update_header makes room for the audio streams */
+
+   AVI->header_bytes = HEADERBYTES+ODML_INDX_BYTES;
+   AVI->odml_streams = 1;
 
-   for (i=0;i<HEADERBYTES;i++) AVI_header[i] = 0;
-   i = avi_write(AVI->fdes,(char *)AVI_header,HEADERBYTES);
-   if (i != HEADERBYTES)
+   for (i=0;i<AVI->header_bytes;i++) AVI_header[i] = 0;
+   i = avi_write(AVI->fdes,(char *)AVI_header,AVI->header_bytes);
+   if (i != AVI->header_bytes)
    {
       close(AVI->fdes);
       AVI_errno = AVI_ERR_WRITE;
@@ -277,7 +428,7 @@ avi_t* AVI_open_output_file(char * filename)
       return 0;
    }
 
-   AVI->pos  = HEADERBYTES;
+   AVI->pos  = AVI->header_bytes;
    AVI->mode = AVI_MODE_WRITE; /* open for writing */
 
    //init
@@ -333,29 +484,89 @@ void AVI_set_audio(avi_t *AVI, int channels, long rate, int bits, int format, lo
 }
 
 #define OUT4CC(s) \
-   if(nhb<=HEADERBYTES-4) memcpy(AVI_header+nhb,s,4); nhb += 4
+   if(nhb<=AVI_HEADER_MAX-4) memcpy(AVI_header+nhb,s,4); nhb += 4
 
 #define OUTLONG(n) \
-   if(nhb<=HEADERBYTES-4) long2str(AVI_header+nhb,n); nhb += 4
+   if(nhb<=AVI_HEADER_MAX-4) long2str(AVI_header+nhb,n); nhb += 4
 
 #define OUTSHRT(n) \
-   if(nhb<=HEADERBYTES-2) { \
+   if(nhb<=AVI_HEADER_MAX-2) { \
       AVI_header[nhb  ] = (n   )&0xff; \
       AVI_header[nhb+1] = (n>>8)&0xff; \
    } \
    nhb += 2
 
+/* Tag of the chunks of a stream: 0 is the video, 1.. the audio tracks */
+
+static void avi_stream_tag(int stream, unsigned char *tag)
+{
+   char str[16];
+
+   if(stream == 0)
+      memcpy(tag,"00db",4);
+   else {
+      sprintf(str, "0%1dwb", stream);
+      memcpy(tag,str,4);
+   }
+}
+
+/* Output the OpenDML super index of a stream into the header. As long
+   as the file has only one RIFF, a JUNK chunk keeps its place */
+
+static long avi_out_indx(avi_t *AVI, unsigned char *AVI_header, long nhb, int stream)
+{
+   unsigned char tag[4];
+
+   if(stream >= AVI->odml_streams) return nhb;
+
+   if(!AVI->is_opendml)
+   {
+      OUT4CC ("JUNK");
+      OUTLONG(ODML_INDX_BYTES-8);
+      memset(AVI_header+nhb,0,ODML_INDX_BYTES-8);
+      return nhb + ODML_INDX_BYTES-8;
+   }
+
+   avi_stream_tag(stream, tag);
+
+   OUT4CC ("indx");
+   OUTLONG(ODML_INDX_BYTES-8);     /* # of bytes to follow */
+   OUTSHRT(4);                     /* LongsPerEntry */
+   OUTSHRT(AVI_INDEX_OF_INDEXES<<8); /* IndexSubType, IndexType */
+   OUTLONG(AVI->sidx_n[stream]);   /* EntriesInUse */
+   OUT4CC (tag);                   /* ChunkId */
+   OUTLONG(0);                     /* Reserved */
+   OUTLONG(0);
+   OUTLONG(0);
+
+   /* Offset, size and duration of the standard indexes */
+
+   memcpy(AVI_header+nhb,AVI->sidx+stream*NR_IXNN_CHUNKS*16,NR_IXNN_CHUNKS*16);
+   return nhb + NR_IXNN_CHUNKS*16;
+}
+
 
 //ThOe write preliminary AVI file header: 0 frames, max vid/aud size
 int avi_update_header(avi_t *AVI)
 {
-   int njunk, sampsize, hasIndex, ms_per_frame, frate, flag;
+   int njunk, hasIndex, ms_per_frame, frate, flag;
+   long scale, byterate;
    int movi_len, hdrl_start, strl_start, j;
-   unsigned char AVI_header[HEADERBYTES];
+   unsigned char AVI_header[AVI_HEADER_MAX];
    long nhb;
 
+   /* As long as nothing has been written, make room in the header
+      for the super index of every stream */
+
+   if(AVI->n_idx == 0 && AVI->n_riff == 0 && AVI->pos == AVI->header_bytes)
+   {
+     AVI->odml_streams = AVI->anum+1;
+     AVI->header_bytes = HEADERBYTES + AVI->odml_streams*ODML_INDX_BYTES;
+     AVI->pos = AVI->header_bytes;
+   }
+
    //assume max size
-   movi_len = AVI_MAX_LEN - HEADERBYTES + 4;
+   movi_len = AVI_MAX_LEN - AVI->header_bytes + 4;
 
    //assume index will be written
    hasIndex=1;
@@ -467,6 +678,8 @@ int avi_update_header(avi_t *AVI)
    OUTLONG(0);                  /* ClrUsed: Number of colors used */
    OUTLONG(0);                  /* ClrImportant: Number of colors important */
 
+   nhb = avi_out_indx(AVI, AVI_header, nhb, 0);
+
    /* Finish stream list, i.e. put number of bytes in the list to proper pos */
 
    long2str(AVI_header+strl_start-4,nhb-strl_start);
@@ -476,7 +689,7 @@ int avi_update_header(avi_t *AVI)
    
    for(j=0; j<AVI->anum; ++j) {
        
-       sampsize = avi_sampsize(AVI, j);
+       avi_audio_units(AVI, j, &scale, &byterate);
    
        OUT4CC ("LIST");
        OUTLONG(0);        /* Length of list in bytes, don't know yet */
@@ -499,15 +712,15 @@ int avi_update_header(avi_t *AVI)
        OUTLONG(0);             /* InitialFrames */
        
        // ThOe /4
-       OUTLONG(sampsize/4);      /* Scale */
-       OUTLONG(1000*AVI->track[j].mp3rate/8);
+       OUTLONG(scale);      /* Scale */
+       OUTLONG(byterate);
        OUTLONG(0);             /* Start */
-       OUTLONG(4*AVI->track[j].audio_bytes/sampsize);   /* Length */
+       OUTLONG(AVI->track[j].audio_bytes/scale);   /* Length */
        OUTLONG(0);             /* SuggestedBufferSize */
        OUTLONG(-1);            /* Quality */
        
        // ThOe /4
-       OUTLONG(sampsize/4);    /* SampleSize */
+       OUTLONG(scale);    /* SampleSize */
        
        OUTLONG(0);             /* Frame */
        OUTLONG(0);             /* Frame */
@@ -522,14 +735,16 @@ int avi_update_header(avi_t *AVI)
        OUTSHRT(AVI->track[j].a_chans);         /* Number of channels */
        OUTLONG(AVI->track[j].a_rate);          /* SamplesPerSec */
        // ThOe
-       OUTLONG(1000*AVI->track[j].mp3rate/8);
+       OUTLONG(byterate);
        //ThOe (/4)
        
-       OUTSHRT(sampsize/4);           /* BlockAlign */
+       OUTSHRT(scale);           /* BlockAlign */
        
        
        OUTSHRT(AVI->track[j].a_bits);          /* BitsPerSample */
        
+       nhb = avi_out_indx(AVI, AVI_header, nhb, j+1);
+
        /* Finish stream list, i.e. put number of bytes in the list to proper pos */
        
        long2str(AVI_header+strl_start-4,nhb-strl_start);
@@ -542,7 +757,7 @@ int avi_update_header(avi_t *AVI)
    
    /* Calculate the needed amount of junk bytes, output junk */
    
-   njunk = HEADERBYTES - nhb - 8 - 12;
+   njunk = AVI->header_bytes - nhb - 8 - 12;
    
    /* Safety first: if njunk <= 0, somebody has played with
       HEADERBYTES without knowing what (s)he did.
@@ -576,8 +791,9 @@ int avi_update_header(avi_t *AVI)
    /* Output the header, truncate the file to the number of bytes
       actually written, report an error if someting goes wrong */
 
-   if ( lseek(AVI->fdes,0,SEEK_SET)<0 ||
-        avi_write(AVI->fdes,(char *)AVI_header,HEADERBYTES)!=HEADERBYTES ||
+   if ( avi_flush(AVI) ||
+        lseek(AVI->fdes,0,SEEK_SET)<0 ||
+        avi_write(AVI->fdes,(char *)AVI_header,AVI->header_bytes)!=(size_t)AVI->header_bytes ||
 	lseek(AVI->fdes,AVI->pos,SEEK_SET)<0)
      {
        AVI_errno = AVI_ERR_CLOSE;
@@ -587,6 +803,178 @@ int avi_update_header(avi_t *AVI)
    return 0;
 }
 
+/* Bytes needed to finish the current RIFF with n index entries:
+   the standard indexes and, in the first RIFF, the idx1 */
+
+static avi_off_t avi_index_bytes(avi_t *AVI, long n)
+{
+   avi_off_t len = (AVI->anum+1)*(8+24) + n*8;
+
+   if(AVI->riff_start == 0) len += 8 + n*16;
+   return len;
+}
+
+/* Write the standard index (ix##) of one stream for the current RIFF
+   and enter it into the super index.
+   returns -1 on error, 0 on success */
+
+static int avi_write_std_index(avi_t *AVI, int stream)
+{
+   unsigned char tag[4], ixtag[16], *ix, *sidx;
+   long i, n, len;
+   int rel, min_rel = 0, ret;
+   unsigned long size;
+   long scale, byterate;
+   avi_off_t pos, duration = 0;
+
+   avi_stream_tag(stream, tag);
+
+   /* The chunk of a duplicated frame may lie before the RIFF,
+      so the base offset is the lowest position of all entries */
+
+   n = 0;
+   for(i=0;i<AVI->n_idx;i++) {
+     if(memcmp(AVI->idx[i],tag,4)) continue;
+     rel = (int)str2ulong(AVI->idx[i]+8);
+     if(n==0 || rel<min_rel) min_rel = rel;
+     n++;
+   }
+   if(n==0) return 0;
+
+   len = 24 + n*8;
+   ix = (unsigned char *) malloc(len);
+   if(ix==0) {
+     AVI_errno = AVI_ERR_NO_MEM;
+     return -1;
+   }
+
+   ix[0] = 2; ix[1] = 0;            /* LongsPerEntry */
+   ix[2] = 0;                       /* IndexSubType */
+   ix[3] = AVI_INDEX_OF_CHUNKS;     /* IndexType */
+   long2str(ix+4,n);                /* EntriesInUse */
+   memcpy(ix+8,tag,4);              /* ChunkId */
+   long2str64(ix+12,AVI->riff_start+min_rel); /* BaseOffset */
+   long2str(ix+20,0);               /* Reserved */
+
+   /* Entries: offset of the data, size with bit 31 set for delta frames */
+
+   n = 0;
+   for(i=0;i<AVI->n_idx;i++) {
+     if(memcmp(AVI->idx[i],tag,4)) continue;
+     rel  = (int)str2ulong(AVI->idx[i]+8);
+     size = str2ulong(AVI->idx[i]+12) & 0x7fffffff;
+     duration += size;
+     if(stream == 0 && !(str2ulong(AVI->idx[i]+4) & 0x10)) size |= 0x80000000;
+     long2str(ix+24+n*8,rel-min_rel+8);
+     long2str(ix+28+n*8,(int)size);
+     n++;
+   }
+
+   /* Duration in units of the stream header: frames or samples */
+
+   if(stream == 0)
+     duration = n;
+   else {
+     avi_audio_units(AVI, stream-1, &scale, &byterate);
+     duration = duration/scale;
+   }
+
+   pos = AVI->pos;
+   sprintf((char *)ixtag, "ix%02d", stream);
+   ret = avi_add_chunk(AVI,ixtag,ix,len);
+   free(ix);
+   if(ret) return -1;
+
+   sidx = AVI->sidx + (stream*NR_IXNN_CHUNKS + AVI->sidx_n[stream])*16;
+   long2str64(sidx,pos);             /* Offset */
+   long2str(sidx+8,8+len);           /* Size */
+   long2str(sidx+12,(int)duration);  /* Duration */
+   AVI->sidx_n[stream]++;
+
+   return 0;
+}
+
+/* Finish the current RIFF: the standard indexes go to the end of its
+   movi list, the first RIFF also keeps an idx1 for players that don't
+   know OpenDML. The sizes of the first RIFF are written with the
+   header, those of a RIFF-AVIX right away.
+   returns -1 on error, 0 on success */
+
+static int avi_end_riff(avi_t *AVI)
+{
+   unsigned char c[4];
+   int j;
+
+   if(AVI->sidx == 0) {
+     AVI->sidx = (unsigned char *) calloc(AVI->odml_streams*NR_IXNN_CHUNKS,16);
+     if(AVI->sidx == 0) {
+       AVI_errno = AVI_ERR_NO_MEM;
+       return -1;
+     }
+   }
+
+   for(j=0; j<=AVI->anum; ++j)
+     if(avi_write_std_index(AVI,j)) return -1;
+
+   if(AVI->riff_start == 0)
+   {
+      AVI->movi0_len = AVI->pos - AVI->header_bytes + 4;
+      if(avi_add_chunk(AVI,(unsigned char *)"idx1",(unsigned char *)AVI->idx,AVI->n_idx*16)) return -1;
+      AVI->riff0_len = AVI->pos - 8;
+      AVI->riff0_frames = AVI->video_frames;
+   }
+   else
+   {
+      if(avi_flush(AVI)) return -1;
+
+      long2str(c,AVI->pos - AVI->riff_start - 8);
+      if( lseek(AVI->fdes,AVI->riff_start+4,SEEK_SET)<0 ||
+          avi_write(AVI->fdes,(char *)c,4)!=4 ) goto write_error;
+
+      long2str(c,AVI->pos - AVI->riff_start - 20);
+      if( lseek(AVI->fdes,AVI->riff_start+16,SEEK_SET)<0 ||
+          avi_write(AVI->fdes,(char *)c,4)!=4 ) goto write_error;
+
+      if( lseek(AVI->fdes,AVI->pos,SEEK_SET)<0 ) goto write_error;
+   }
+
+   AVI->n_idx = 0;
+   return 0;
+
+ write_error:
+   AVI->write_failed = 1;
+   AVI_errno = AVI_ERR_WRITE;
+   return -1;
+}
+
+/* Finish the current RIFF and start a RIFF-AVIX with its movi list,
+   returns -1 on error, 0 on success */
+
+static int avi_new_riff(avi_t *AVI)
+{
+   unsigned char c[24];
+
+   if(avi_end_riff(AVI) || avi_flush(AVI)) return -1;
+
+   memcpy(c   ,"RIFF",4); long2str(c+ 4,0); memcpy(c+ 8,"AVIX",4);
+   memcpy(c+12,"LIST",4); long2str(c+16,0); memcpy(c+20,"movi",4);
+
+   if( avi_write(AVI->fdes,(char *)c,24)!=24 )
+   {
+      /* the last RIFF has been finished already */
+      AVI->write_failed = 1;
+      AVI_errno = AVI_ERR_WRITE;
+      return -1;
+   }
+
+   AVI->riff_start = AVI->pos;
+   AVI->pos += 24;
+   AVI->n_riff++;
+   AVI->is_opendml = 1;
+
+   return 0;
+}
+
 /*
   Write the header of an AVI file and close it.
   returns 0 on success, -1 on write error.
@@ -595,10 +983,12 @@ int avi_update_header(avi_t *AVI)
 static int avi_close_output_file(avi_t *AVI)
 {
 
-   int ret, njunk, sampsize, hasIndex, ms_per_frame, frate, idxerror, flag;
-   unsigned long movi_len;
+   int ret, njunk, hasIndex, ms_per_frame, frate, idxerror, flag;
+   long scale, byterate;
+   unsigned long movi_len, riff_len;
+   long total_frames;
    int hdrl_start, strl_start, j;
-   unsigned char AVI_header[HEADERBYTES];
+   unsigned char AVI_header[AVI_HEADER_MAX];
    long nhb;
 
 #ifdef INFO_LIST
@@ -606,19 +996,40 @@ static int avi_close_output_file(avi_t *AVI)
 //   time_t calptr;
 #endif
 
-   /* Calculate length of movi list */
-
-   movi_len = AVI->pos - HEADERBYTES + 4;
-
    /* Try to ouput the index entries. This may fail e.g. if no space
       is left on device. We will report this as an error, but we still
       try to write the header correctly (so that the file still may be
       readable in the most cases */
 
    idxerror = 0;
-   //   fprintf(stderr, "pos=%lu, index_len=%ld             \n", AVI->pos, AVI->n_idx*16);
-   ret = avi_add_chunk(AVI, (unsigned char *)"idx1", (unsigned char *)AVI->idx, AVI->n_idx*16);
-   hasIndex = (ret==0);
+
+   if(AVI->is_opendml)
+   {
+      /* Finish the last RIFF-AVIX, the header describes the first RIFF
+         whose idx1 has already been written */
+
+      ret = avi_end_riff(AVI);
+      if(ret==0) ret = avi_flush(AVI);
+      hasIndex = 1;
+
+      movi_len = AVI->movi0_len;
+      riff_len = AVI->riff0_len;
+      total_frames = AVI->riff0_frames;
+   }
+   else
+   {
+      /* Calculate length of movi list */
+
+      movi_len = AVI->pos - AVI->header_bytes + 4;
+
+      //   fprintf(stderr, "pos=%lu, index_len=%ld             \n", AVI->pos, AVI->n_idx*16);
+      ret = avi_add_chunk(AVI, (unsigned char *)"idx1", (unsigned char *)AVI->idx, AVI->n_idx*16);
+      if(ret==0) ret = avi_flush(AVI);
+      hasIndex = (ret==0);
+
+      riff_len = AVI->pos - 8;
+      total_frames = AVI->video_frames;
+   }
    //fprintf(stderr, "pos=%lu, index_len=%d\n", AVI->pos, hasIndex);
 
    if(ret) {
@@ -643,7 +1054,7 @@ static int avi_close_output_file(avi_t *AVI)
    /* The RIFF header */
 
    OUT4CC ("RIFF");
-   OUTLONG(AVI->pos - 8);    /* # of bytes to follow */
+   OUTLONG(riff_len);        /* # of bytes to follow */
    OUT4CC ("AVI ");
 
    /* Start the header list */
@@ -676,7 +1087,7 @@ static int avi_close_output_file(avi_t *AVI)
    if(hasIndex) flag |= AVIF_HASINDEX;
    if(hasIndex && AVI->must_use_index) flag |= AVIF_MUSTUSEINDEX;
    OUTLONG(flag);               /* Flags */
-   OUTLONG(AVI->video_frames);  /* TotalFrames */
+   OUTLONG(total_frames);       /* TotalFrames (of the first RIFF) */
    OUTLONG(0);                  /* InitialFrames */
 
    OUTLONG(AVI->anum+1);
@@ -739,6 +1150,8 @@ static int avi_close_output_file(avi_t *AVI)
    OUTLONG(0);                  /* ClrUsed: Number of colors used */
    OUTLONG(0);                  /* ClrImportant: Number of colors important */
 
+   nhb = avi_out_indx(AVI, AVI_header, nhb, 0);
+
    /* Finish stream list, i.e. put number of bytes in the list to proper pos */
 
    long2str(AVI_header+strl_start-4,nhb-strl_start);
@@ -750,7 +1163,7 @@ static int avi_close_output_file(avi_t *AVI)
      //if (AVI->track[j].a_chans && AVI->track[j].audio_bytes)
        {
 	   
-	 sampsize = avi_sampsize(AVI, j);
+	 avi_audio_units(AVI, j, &scale, &byterate);
 	   
 	 OUT4CC ("LIST");
 	 OUTLONG(0);        /* Length of list in bytes, don't know yet */
@@ -773,15 +1186,15 @@ static int avi_close_output_file(avi_t *AVI)
 	 OUTLONG(0);             /* InitialFrames */
 	   
 	 // ThOe /4
-	 OUTLONG(sampsize/4);      /* Scale */
-	 OUTLONG(1000*AVI->track[j].mp3rate/8);
+	 OUTLONG(scale);      /* Scale */
+	 OUTLONG(byterate);
 	 OUTLONG(0);             /* Start */
-	 OUTLONG(4*AVI->track[j].audio_bytes/sampsize);   /* Length */
+	 OUTLONG(AVI->track[j].audio_bytes/scale);   /* Length */
 	 OUTLONG(0);             /* SuggestedBufferSize */
 	 OUTLONG(-1);            /* Quality */
 	   
 	 // ThOe /4
-	 OUTLONG(sampsize/4);    /* SampleSize */
+	 OUTLONG(scale);    /* SampleSize */
 	   
 	 OUTLONG(0);             /* Frame */
 	 OUTLONG(0);             /* Frame */
@@ -796,18 +1209,34 @@ static int avi_close_output_file(avi_t *AVI)
 	 OUTSHRT(AVI->track[j].a_chans);         /* Number of channels */
 	 OUTLONG(AVI->track[j].a_rate);          /* SamplesPerSec */
 	 // ThOe
-	 OUTLONG(1000*AVI->track[j].mp3rate/8);
+	 OUTLONG(byterate);
 	 //ThOe (/4)
 	 
-	 OUTSHRT(sampsize/4);           /* BlockAlign */
+	 OUTSHRT(scale);           /* BlockAlign */
 	 
 	 
 	 OUTSHRT(AVI->track[j].a_bits);          /* BitsPerSample */
 	 
+	 nhb = avi_out_indx(AVI, AVI_header, nhb, j+1);
+
 	 /* Finish stream list, i.e. put number of bytes in the list to proper pos */
        }
        long2str(AVI_header+strl_start-4,nhb-strl_start);
    }
+
+   /* OpenDML extended header: the frames of all RIFFs */
+
+   if(AVI->is_opendml)
+   {
+      OUT4CC ("LIST");
+      OUTLONG(4+8+248);
+      OUT4CC ("odml");
+      OUT4CC ("dmlh");
+      OUTLONG(248);                /* # of bytes to follow */
+      OUTLONG(AVI->video_frames);  /* TotalFrames */
+      memset(AVI_header+nhb,0,244);
+      nhb += 244;
+   }
    
    /* Finish header list */
    
@@ -854,7 +1283,7 @@ static int avi_close_output_file(avi_t *AVI)
    
    /* Calculate the needed amount of junk bytes, output junk */
    
-   njunk = HEADERBYTES - nhb - 8 - 12;
+   njunk = AVI->header_bytes - nhb - 8 - 12;
    
    /* Safety first: if njunk <= 0, somebody has played with
       HEADERBYTES without knowing what (s)he did.
@@ -882,7 +1311,7 @@ static int avi_close_output_file(avi_t *AVI)
       actually written, report an error if someting goes wrong */
 
    if ( lseek(AVI->fdes,0,SEEK_SET)<0 ||
-        avi_write(AVI->fdes,(char *)AVI_header,HEADERBYTES)!=HEADERBYTES ||
+        avi_write(AVI->fdes,(char *)AVI_header,AVI->header_bytes)!=(size_t)AVI->header_bytes ||
         ftruncate(AVI->fdes,AVI->pos)<0 )
    {
       AVI_errno = AVI_ERR_CLOSE;
@@ -910,22 +1339,35 @@ static int avi_write_data(avi_t *AVI, char *data, unsigned long length, int audi
 
    unsigned char astr[5];
 
-   /* Check for maximum file length */
+   if(AVI->write_failed) { AVI_errno = AVI_ERR_WRITE; return -1; }
+
+   /* Check for maximum file length. If every stream has a super index,
+      the file goes on in a new RIFF instead (OpenDML) */
    
-   if ( (AVI->pos + 8 + length + 8 + (AVI->n_idx+1)*16) > AVI_MAX_LEN ) {
+   if ( AVI->odml_streams == AVI->anum+1 ) {
+     if ( AVI->n_idx > 0 && AVI->pos - AVI->riff_start + 8 + PAD_EVEN(length) +
+          avi_index_bytes(AVI,AVI->n_idx+1) > NEW_RIFF_THRES ) {
+       if ( AVI->n_riff+1 >= NR_IXNN_CHUNKS ) {
+         AVI_errno = AVI_ERR_SIZELIM;
+         return -1;
+       }
+       if ( avi_new_riff(AVI) ) return -1;
+     }
+   }
+   else if ( (AVI->pos + 8 + length + 8 + (AVI->n_idx+1)*16) > AVI_MAX_LEN ) {
      AVI_errno = AVI_ERR_SIZELIM;
      return -1;
    }
    
-   /* Add index entry */
+   /* Add index entry, relative to the current RIFF */
 
    //set tag for current audio track
    sprintf((char *)astr, "0%1dwb", (int)(AVI->aptr+1));
 
    if(audio)
-     n = avi_add_index_entry(AVI,astr,0x00,AVI->pos,length);
+     n = avi_add_index_entry(AVI,astr,0x00,AVI->pos - AVI->riff_start,length);
    else
-     n = avi_add_index_entry(AVI,(unsigned char *)"00db",((keyframe)?0x10:0x0),AVI->pos,length);
+     n = avi_add_index_entry(AVI,(unsigned char *)"00db",((keyframe)?0x10:0x0),AVI->pos - AVI->riff_start,length);
    
    if(n) return -1;
    
@@ -943,15 +1385,12 @@ static int avi_write_data(avi_t *AVI, char *data, unsigned long length, int audi
 
 int AVI_write_frame(avi_t *AVI, char *data, long bytes, int keyframe)
 {
-  unsigned long pos;
-  
   if(AVI->mode==AVI_MODE_READ) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
   
-  pos = AVI->pos;
-
   if(avi_write_data(AVI,data,bytes,0,keyframe)) return -1;
    
-  AVI->last_pos = pos;
+  // the chunk just written, maybe in a new RIFF
+  AVI->last_pos = AVI->pos - 8 - PAD_EVEN(bytes);
   AVI->last_len = bytes;
   AVI->video_frames++;
   return 0;
@@ -960,9 +1399,10 @@ int AVI_write_frame(avi_t *AVI, char *data, long bytes, int keyframe)
 int AVI_dup_frame(avi_t *AVI)
 {
    if(AVI->mode==AVI_MODE_READ) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
+   if(AVI->write_failed) { AVI_errno = AVI_ERR_WRITE; return -1; }
 
    if(AVI->last_pos==0) return 0; /* No previous real frame */
-   if(avi_add_index_entry(AVI,(unsigned char *)"00db",0x10,AVI->last_pos,AVI->last_len)) return -1;
+   if(avi_add_index_entry(AVI,(unsigned char *)"00db",0x10,AVI->last_pos - AVI->riff_start,AVI->last_len)) return -1;
    AVI->video_frames++;
    AVI->must_use_index = 1;
    return 0;
@@ -981,16 +1421,24 @@ int AVI_write_audio(avi_t *AVI, char *data, long bytes)
 int AVI_append_audio(avi_t *AVI, char *data, long bytes)
 {
 
-  long i, length, pos;
+  long i, length;
+  avi_off_t pos;
   unsigned char c[4];
 
   if(AVI->mode==AVI_MODE_READ) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
+  if(AVI->write_failed) { AVI_errno = AVI_ERR_WRITE; return -1; }
+
+  // a new RIFF has just been started, nothing to append to
+  if(AVI->n_idx == 0) return AVI_write_audio(AVI, data, bytes);
+
+  // the chunk to append to may still be in the output buffer
+  if(avi_flush(AVI)) return -1;
   
   // update last index entry:
   
   --AVI->n_idx;
   length = str2ulong(AVI->idx[AVI->n_idx]+12);
-  pos    = str2ulong(AVI->idx[AVI->n_idx]+8);
+  pos    = AVI->riff_start + (int)str2ulong(AVI->idx[AVI->n_idx]+8);
 
   //update;
   long2str(AVI->idx[AVI->n_idx]+12,length+bytes);   
@@ -1000,36 +1448,122 @@ int AVI_append_audio(avi_t *AVI, char *data, long bytes)
   AVI->track[AVI->aptr].audio_bytes += bytes;
 
   //update chunk header
-  lseek(AVI->fdes, pos+4, SEEK_SET);
   long2str(c, length+bytes);     
-  avi_write(AVI->fdes, (char *)c, 4);
-
-  lseek(AVI->fdes, pos+8+length, SEEK_SET);
+  if( lseek(AVI->fdes, pos+4, SEEK_SET)<0 ||
+      avi_write(AVI->fdes, (char *)c, 4)!=4 ) goto write_error;
 
   i=PAD_EVEN(length + bytes);
 
   bytes = i - length;
-  avi_write(AVI->fdes, data, bytes);
+  if( lseek(AVI->fdes, pos+8+length, SEEK_SET)<0 ||
+      avi_write(AVI->fdes, data, bytes)!=(size_t)bytes ) goto write_error;
   AVI->pos = pos + 8 + i;
 
   return 0;
+
+ write_error:
+  AVI->write_failed = 1;
+  AVI_errno = AVI_ERR_WRITE;
+  return -1;
 }
 
 
-long AVI_bytes_remain(avi_t *AVI)
+/* Bytes left before the size limit, checked the same way as in
+   AVI_write_data: with OpenDML the limit is for the current RIFF,
+   which starts at riff_start */
+
+avi_off_t AVI_bytes_remain(avi_t *AVI)
 {
    if(AVI->mode==AVI_MODE_READ) return 0;
 
+   if ( AVI->odml_streams == AVI->anum+1 )
+      return ( NEW_RIFF_THRES - (AVI->pos - AVI->riff_start + 8 + avi_index_bytes(AVI,AVI->n_idx)) );
+
    return ( AVI_MAX_LEN - (AVI->pos + 8 + 16*AVI->n_idx));
 }
 
-long AVI_bytes_written(avi_t *AVI)
+avi_off_t AVI_bytes_written(avi_t *AVI)
 {
    if(AVI->mode==AVI_MODE_READ) return 0;
 
    return (AVI->pos + 8 + 16*AVI->n_idx);
 }
 
+/*
+   AVI_set_output_buffer: Collect chunks in a user space buffer of
+                          size bytes and write them out when it is full,
+                          instead of one write per chunk.
+                          size 0 goes back to direct writes.
+
+   returns 0 on success, -1 on error
+*/
+
+int AVI_set_output_buffer(avi_t *AVI, long size)
+{
+   if(AVI->mode==AVI_MODE_READ) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
+
+   if(avi_flush(AVI)) return -1;
+
+   free(AVI->wbuf);
+   AVI->wbuf = 0;
+   AVI->wbuf_size = 0;
+
+   if(size <= 0) return 0;
+
+   AVI->wbuf = (char *) malloc(size);
+   if(AVI->wbuf == 0) {
+     AVI_errno = AVI_ERR_NO_MEM;
+     return -1;
+   }
+   AVI->wbuf_size = size;
+
+   return 0;
+}
+
+/*
+   AVI_set_output_hint: Tell how many chunks (video and audio) will
+                        be written and about how big they are on
+                        average (0 if unknown).
+                        The index is allocated for all of them at once
+                        and, where supported, the disk space is reserved
+                        in advance, up to AVI_MAX_RESERVE bytes. The file
+                        is still truncated to its real length when it is
+                        closed.
+
+   returns 0 on success, -1 on error
+*/
+
+int AVI_set_output_hint(avi_t *AVI, long chunks, long chunk_bytes)
+{
+   void *ptr;
+
+   if(AVI->mode==AVI_MODE_READ) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
+
+   if(chunks > AVI->max_idx) {
+     ptr = realloc((void *)AVI->idx,chunks*16);
+
+     if(ptr == 0) {
+       AVI_errno = AVI_ERR_NO_MEM;
+       return -1;
+     }
+     AVI->max_idx = chunks;
+     AVI->idx = (unsigned char((*)[16]) ) ptr;
+   }
+
+#if defined(__linux__)
+   if(chunks > 0 && chunk_bytes > 0) {
+     double len = (double)AVI->pos + (double)chunks*(8+PAD_EVEN(chunk_bytes)+16) + 8;
+
+     if(len > AVI_MAX_RESERVE) len = AVI_MAX_RESERVE;
+     posix_fallocate(AVI->fdes, 0, (off_t)len); // only a hint, errors don't matter
+   }
+#else
+   (void)chunk_bytes;
+#endif
+
+   return 0;
+}
+
 int AVI_set_audio_track(avi_t *AVI, int track)
 {
   
@@ -1059,7 +1593,13 @@ int AVI_close(avi_t *AVI)
    /* If the file was open for writing, the header and index still have
       to be written */
 
-   if(AVI->mode == AVI_MODE_WRITE)
+   if(AVI->mode == AVI_MODE_WRITE && AVI->write_failed)
+   {
+      /* the index does not match the file, leave it unfinished */
+      AVI_errno = AVI_ERR_WRITE;
+      ret = -1;
+   }
+   else if(AVI->mode == AVI_MODE_WRITE)
       ret = avi_close_output_file(AVI);
    else
       ret = 0;
@@ -1067,7 +1607,9 @@ int AVI_close(avi_t *AVI)
    /* Even if there happened an error, we first clean up */
 
    close(AVI->fdes);
+   if(AVI->wbuf) free(AVI->wbuf);
    if(AVI->idx) free(AVI->idx);
+   if(AVI->sidx) free(AVI->sidx);
    if(AVI->video_index) free(AVI->video_index);
    //FIXME
    //if(AVI->audio_index) free(AVI->audio_index);
@@ -1155,6 +1697,80 @@ avi_t *AVI_open_fd(int fd, int getIndex)
   return AVI;
 }
 
+/* Read the standard indexes listed in an OpenDML super index (indx)
+   into the video index (stream 0) or the index of an audio track.
+   returns -1 on error, 0 on success */
+
+static int avi_read_odml_index(avi_t *AVI, unsigned char *indx, long entries, int stream)
+{
+   unsigned char hdr[32], *ix;
+   avi_off_t base, tot = 0;
+   long e, k, n, count = 0;
+   unsigned long size;
+   void *ptr;
+   track_t *track = stream ? &AVI->track[stream-1] : 0;
+
+   for(e=0; e<entries; e++)
+   {
+      /* ix## chunk header: tag, length, LongsPerEntry, IndexSubType,
+         IndexType, EntriesInUse, ChunkId, BaseOffset, Reserved */
+
+      if( lseek(AVI->fdes,str2ulong64(indx+e*16),SEEK_SET)<0 ||
+          avi_read(AVI->fdes,(char *)hdr,32) != 32 ) return -1;
+      if( strncasecmp((char *)hdr,"ix",2) != 0 || str2ushort(hdr+8) != 2 ||
+          hdr[11] != AVI_INDEX_OF_CHUNKS ) return -1;
+
+      n = str2ulong(hdr+12) & 0xffffffffUL;
+      if( n < 0 || n > ((long)(str2ulong(hdr+4) & 0xffffffffUL)-24)/8 ) return -1;
+      base = str2ulong64(hdr+20);
+      if(n == 0) continue;
+
+      ix = (unsigned char *) malloc(n*8);
+      if(ix == 0) { AVI_errno = AVI_ERR_NO_MEM; return -1; }
+      if( avi_read(AVI->fdes,(char *)ix,n*8) != (size_t)(n*8) ) { free(ix); return -1; }
+
+      if(stream == 0)
+      {
+         ptr = realloc(AVI->video_index,(count+n)*sizeof(video_index_entry));
+         if(ptr == 0) { free(ix); AVI_errno = AVI_ERR_NO_MEM; return -1; }
+         AVI->video_index = (video_index_entry *) ptr;
+
+         for(k=0; k<n; k++, count++)
+         {
+            size = str2ulong(ix+k*8+4) & 0xffffffffUL;
+            AVI->video_index[count].key = (size & 0x80000000) ? 0 : 0x10;
+            AVI->video_index[count].pos = base + (str2ulong(ix+k*8) & 0xffffffffUL);
+            AVI->video_index[count].len = size & 0x7fffffff;
+            if((unsigned long)AVI->video_index[count].len > AVI->max_len)
+               AVI->max_len = AVI->video_index[count].len;
+         }
+         AVI->video_frames = count;
+      }
+      else
+      {
+         /* one entry more, AVI_read_audio_chunk stops at a zero length */
+
+         ptr = realloc(track->audio_index,(count+n+1)*sizeof(audio_index_entry));
+         if(ptr == 0) { free(ix); AVI_errno = AVI_ERR_NO_MEM; return -1; }
+         track->audio_index = (audio_index_entry *) ptr;
+
+         for(k=0; k<n; k++, count++)
+         {
+            track->audio_index[count].pos = base + (str2ulong(ix+k*8) & 0xffffffffUL);
+            track->audio_index[count].len = str2ulong(ix+k*8+4) & 0x7fffffff;
+            track->audio_index[count].tot = tot;
+            tot += track->audio_index[count].len;
+         }
+         memset(&track->audio_index[count],0,sizeof(audio_index_entry));
+         track->audio_chunks = count;
+         track->audio_bytes = tot;
+      }
+      free(ix);
+   }
+
+   return 0;
+}
+
 int avi_parse_input_file(avi_t *AVI, int getIndex)
 {
   long i, rate, scale, idx_type;
@@ -1170,6 +1786,7 @@ int avi_parse_input_file(avi_t *AVI, int getIndex)
   int auds_strh_seen = 0;
   //  int auds_strf_seen = 0;
   int num_stream = 0;
+  int cur_stream = -1; /* 0 video, 1.. audio track of the last strh */
   char data[256];
   
   /* Read first 12 bytes and check that this is an AVI file */
@@ -1265,6 +1882,7 @@ int avi_parse_input_file(avi_t *AVI, int getIndex)
 	    AVI->max_len = 0;
             vids_strh_seen = 1;
             lasttag = 1; /* vids */
+            cur_stream = 0;
          }
          else if (strncasecmp ((char *)hdrl_data+i,"auds",4) ==0 && ! auds_strh_seen)
          {
@@ -1282,13 +1900,17 @@ int avi_parse_input_file(avi_t *AVI, int getIndex)
 	   AVI->track[AVI->aptr].audio_strn = num_stream;
 	   //	   auds_strh_seen = 1;
 	   lasttag = 2; /* auds */
+	   cur_stream = AVI->anum;
 	   
 	   // ThOe
 	   AVI->track[AVI->aptr].a_codech_off = header_offset + i;
 	   
          }
          else
+         {
             lasttag = 0;
+            cur_stream = -1;
+         }
          num_stream++;
       }
       else if(strncasecmp((char *)hdrl_data+i,"strf",4)==0)
@@ -1358,6 +1980,35 @@ int avi_parse_input_file(avi_t *AVI, int getIndex)
          }
          lasttag = 0;
       }
+      else if(strncasecmp((char *)hdrl_data+i,"indx",4)==0)
+      {
+         /* OpenDML super index: read the standard indexes it lists,
+            they replace the idx1 that covers the first RIFF only */
+
+         long entries;
+
+         i += 8;
+         if(getIndex && cur_stream >= 0 && n >= 24 && i+n <= hdrl_len &&
+            str2ushort(hdrl_data+i) == 4 && hdrl_data[i+3] == AVI_INDEX_OF_INDEXES)
+         {
+            entries = str2ulong(hdrl_data+i+4) & 0xffffffffUL;
+            if(entries > (n-24)/16) entries = (n-24)/16;
+
+            if(avi_read_odml_index(AVI, hdrl_data+i+24, entries, cur_stream))
+            {
+               /* broken, fall back to the idx1 */
+               if(cur_stream == 0) {
+                  free(AVI->video_index);
+                  AVI->video_index = 0;
+               } else {
+                  free(AVI->track[cur_stream-1].audio_index);
+                  AVI->track[cur_stream-1].audio_index = 0;
+                  AVI->track[cur_stream-1].audio_chunks = 0;
+               }
+            }
+         }
+         lasttag = 0;
+      }
       else
       {
          i += 8;
@@ -1392,6 +2043,14 @@ int avi_parse_input_file(avi_t *AVI, int getIndex)
 
    if(!getIndex) return(0);
 
+   /* OpenDML: the index has already been read from the standard indexes */
+
+   if(AVI->video_index)
+   {
+      AVI->video_pos = 0;
+      return(0);
+   }
+
    /* if the file has an idx1, check if this is relative
       to the start of the file or to the start of the movi list */
 
@@ -1637,7 +2296,7 @@ long AVI_audio_size(avi_t *AVI, long frame)
   return(AVI->track[AVI->aptr].audio_index[frame].len);
 }
 
-long AVI_get_video_position(avi_t *AVI, long frame)
+avi_off_t AVI_get_video_position(avi_t *AVI, long frame)
 {
    if(AVI->mode==AVI_MODE_WRITE) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
    if(!AVI->video_index)         { AVI_errno = AVI_ERR_NO_IDX;   return -1; }
@@ -1731,7 +2390,8 @@ int AVI_set_audio_position(avi_t *AVI, long byte)
 
 long AVI_read_audio(avi_t *AVI, char *audbuf, long bytes)
 {
-   long nr, pos, left, todo;
+   long nr, left, todo;
+   avi_off_t pos;
 
    if(AVI->mode==AVI_MODE_WRITE) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
    if(!AVI->track[AVI->aptr].audio_index)         { AVI_errno = AVI_ERR_NO_IDX;   return -1; }
@@ -1769,7 +2429,8 @@ long AVI_read_audio(avi_t *AVI, char *audbuf, long bytes)
 
 long AVI_read_audio_chunk(avi_t *AVI, char *audbuf)
 {
-   long pos, left;
+   long left;
+   avi_off_t pos;
 
    if(AVI->mode==AVI_MODE_WRITE) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
    if(!AVI->track[AVI->aptr].audio_index)         { AVI_errno = AVI_ERR_NO_IDX;   return -1; }
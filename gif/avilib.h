@@ -58,18 +58,27 @@
 
 #define AVI_MAX_TRACKS 8
 
+/* File offsets, 64 bit also on WIN32 where off_t has only 32 bits:
+   OpenDML files are bigger than 4 GB */
+
+#ifdef WIN32
+typedef __int64 avi_off_t;
+#else
+typedef off_t avi_off_t;
+#endif
+
 typedef struct
 {
   off_t key;
-  off_t pos;
+  avi_off_t pos;
   off_t len;
 } video_index_entry;
 
 typedef struct
 {
-   off_t pos;
+   avi_off_t pos;
    off_t len;
-   off_t tot;
+   avi_off_t tot;
 } audio_index_entry;
 
 typedef struct track_s
@@ -82,7 +91,7 @@ typedef struct track_s
     long   mp3rate;           /* mp3 bitrate kbs*/
 
     long   audio_strn;        /* Audio stream number */
-    off_t  audio_bytes;       /* Total number of bytes of audio data */
+    avi_off_t audio_bytes;    /* Total number of bytes of audio data */
     long   audio_chunks;      /* Chunks of audio data in the file */
 
     char   audio_tag[4];      /* Tag of audio data */
@@ -168,7 +177,7 @@ typedef struct
   
   track_t track[AVI_MAX_TRACKS];  // up to AVI_MAX_TRACKS audio tracks supported
   
-  off_t pos;        /* position in file */
+  avi_off_t pos;            /* position in file */
   long   n_idx;             /* number of index entries actually filled */
   long   max_idx;           /* number of index entries actually allocated */
   
@@ -178,7 +187,7 @@ typedef struct
   unsigned char (*idx)[16]; /* index entries (AVI idx1 tag) */
   video_index_entry *video_index;
   
-  off_t last_pos;          /* Position of last frame written */
+  avi_off_t last_pos;      /* Position of last frame written */
   unsigned long last_len;          /* Length of last frame written */
   int must_use_index;              /* Flag if frames are duplicated */
   off_t movi_start;
@@ -188,6 +197,27 @@ typedef struct
   
   BITMAPINFOHEADER_avilib *bitmap_info_header;
   WAVEFORMATEX_avilib *wave_format_ex[AVI_MAX_TRACKS];
+
+  char  *wbuf;              /* output buffer, 0 if chunks are written directly */
+  long   wbuf_size;         /* size of the output buffer */
+  long   wbuf_len;          /* bytes waiting in the output buffer */
+  int    write_failed;      /* a write failed after its index entries were
+                               made, every later write and AVI_close fail */
+
+  /* OpenDML (AVI 2.0): when the file grows past one RIFF, it goes on in
+     RIFF-AVIX segments. idx holds the entries of the current segment only,
+     with positions relative to riff_start */
+
+  long   header_bytes;      /* space reserved for the header */
+  int    odml_streams;      /* streams with room for a super index in the header */
+  int    is_opendml;        /* the file has more than one RIFF */
+  long   n_riff;            /* number of RIFF segments finished */
+  avi_off_t riff_start;     /* start of the current RIFF */
+  unsigned long riff0_len;  /* size of the first RIFF */
+  unsigned long movi0_len;  /* size of its movi list */
+  long   riff0_frames;      /* video frames in it */
+  unsigned char *sidx;      /* super index entries, NR_IXNN_CHUNKS per stream */
+  long   sidx_n[AVI_MAX_TRACKS+1];
 } avi_t;
 
 #define AVI_MODE_WRITE  0
@@ -206,7 +236,9 @@ typedef struct
 #define AVI_ERR_READ         3     /* Error reading from AVI File */
 
 #define AVI_ERR_WRITE        4     /* Error writing to AVI File,
-                                      disk full ??? */
+                                      disk full ??? The file cannot be
+                                      finished any more, AVI_close only
+                                      cleans up and fails too */
 
 #define AVI_ERR_WRITE_INDEX  5     /* Could not write index to AVI file
                                       during close, file may still be
@@ -264,9 +296,11 @@ int  AVI_write_frame(avi_t *AVI, char *data, long bytes, int keyframe);
 int  AVI_dup_frame(avi_t *AVI);
 int  AVI_write_audio(avi_t *AVI, char *data, long bytes);
 int  AVI_append_audio(avi_t *AVI, char *data, long bytes);
-long AVI_bytes_remain(avi_t *AVI);
+avi_off_t AVI_bytes_remain(avi_t *AVI);
 int  AVI_close(avi_t *AVI);
-long AVI_bytes_written(avi_t *AVI);
+avi_off_t AVI_bytes_written(avi_t *AVI);
+int  AVI_set_output_buffer(avi_t *AVI, long size);
+int  AVI_set_output_hint(avi_t *AVI, long chunks, long chunk_bytes);
 
 avi_t *AVI_open_input_file(const char *filename, int getIndex);
 avi_t *AVI_open_fd(int fd, int getIndex);
@@ -291,7 +325,7 @@ long AVI_frame_size(avi_t *AVI, long frame);
 long AVI_audio_size(avi_t *AVI, long frame);
 int  AVI_seek_start(avi_t *AVI);
 int  AVI_set_video_position(avi_t *AVI, long frame);
-long AVI_get_video_position(avi_t *AVI, long frame);
+avi_off_t AVI_get_video_position(avi_t *AVI, long frame);
 long AVI_read_frame(avi_t *AVI, char *vidbuf, int *keyframe);
 
 int  AVI_set_audio_position(avi_t *AVI, long byte);
@@ -28,21 +28,28 @@
 #include <stdio.h>   // for FILE*
 #include <string.h>  // for memcpy and bzero
 #include <stdint.h>  // for integer typedefs
+#include <chrono>    // for timing the palette lookup
+#include <thread>    // for ordered dithering on several threads
+#include <mutex>     // for the worker threads of a writer
+#include <condition_variable>
+#include <functional>
 
 // Define these macros to hook into a custom memory allocator.
 // TEMP_MALLOC and TEMP_FREE will only be called in stack fashion - frees in the reverse order of mallocs
 // and any temp memory allocated by a function will be freed before it exits.
 // MALLOC and FREE are used only by GifBegin and GifEnd respectively (to allocate a buffer the size of the image, which
 // is used to find changed pixels for delta-encoding.)
+// By default temp memory comes from the GifWriter's arenas while a frame is being quantized or written
+// (see GifArena), and from malloc otherwise.
 
 #ifndef GIF_TEMP_MALLOC
 #include <stdlib.h>
-#define GIF_TEMP_MALLOC malloc
+#define GIF_TEMP_MALLOC GifTempMalloc
 #endif
 
 #ifndef GIF_TEMP_FREE
 #include <stdlib.h>
-#define GIF_TEMP_FREE free
+#define GIF_TEMP_FREE GifTempFree
 #endif
 
 #ifndef GIF_MALLOC
@@ -55,6 +62,23 @@
 #define GIF_FREE free
 #endif
 
+// The frame differencing has SSE2 and AVX2 versions on x86, picked at runtime.
+// Define GIF_NO_SIMD to only build the plain C++ version.
+#if !defined(GIF_NO_SIMD) && (defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define GIF_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define GIF_AVX2
+#define GIF_TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (_MSC_VER >= 1700)
+#define GIF_AVX2
+#define GIF_TARGET_AVX2
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+#endif
+
 class Gif_H
 {
 public:
@@ -63,6 +87,116 @@ public:
 
 const int kGifTransIndex = 0;
 
+// Scratch memory for one stage of the writer, handed out in stack fashion like GIF_TEMP_MALLOC promises.
+// Between GifEnterArena and GifLeaveArena, GIF_TEMP_MALLOC on that thread takes memory from the arena. Requests that
+// don't fit fall back to malloc, and the arena grows to the largest size seen the next time it is empty,
+// so after the first frame or two a writer does no heap allocation for its temp memory.
+// Threads started by the writer don't allocate: their buffers are taken from the arena before they start.
+struct GifArena
+{
+    uint8_t* base;
+    size_t capacity;
+    size_t top;
+    size_t spilled;         // memory currently taken from the heap because it didn't fit
+    size_t peak;            // the most memory the arena was asked for at once
+    uint32_t heapAllocs;    // debug builds: number of times memory had to come from the heap
+};
+
+void GifArenaInit( GifArena* arena, size_t capacity )
+{
+    arena->base = capacity? (uint8_t*)GIF_MALLOC(capacity) : NULL;
+    arena->capacity = capacity;
+    arena->top = 0;
+    arena->spilled = 0;
+    arena->peak = 0;
+    arena->heapAllocs = 0;
+}
+
+void GifArenaFree( GifArena* arena )
+{
+    if(arena->base)
+        GIF_FREE(arena->base);
+    arena->base = NULL;
+    arena->capacity = 0;
+}
+
+static GifArena*& GifCurrentArena()
+{
+    static thread_local GifArena* arena = NULL;
+    return arena;
+}
+
+void* GifTempMalloc( size_t size )
+{
+    GifArena* arena = GifCurrentArena();
+    if(!arena)
+        return malloc(size);
+
+    const size_t start = (arena->top + 15) & ~(size_t)15;
+    const size_t end = start + ((size + 15) & ~(size_t)15);
+    if(end + arena->spilled > arena->peak)
+        arena->peak = end + arena->spilled;
+
+    if(start + size > arena->capacity)
+    {
+#ifndef NDEBUG
+        ++arena->heapAllocs;
+#endif
+        // remember the size in front of the memory, so that GifTempFree knows how much was spilled
+        uint8_t* mem = (uint8_t*)malloc(size + 16);
+        if(!mem) return NULL;
+        *(size_t*)mem = end - start;
+        arena->spilled += end - start;
+        return mem + 16;
+    }
+
+    arena->top = start + size;
+    return arena->base + start;
+}
+
+void GifTempFree( void* ptr )
+{
+    GifArena* arena = GifCurrentArena();
+    if(!arena)
+    {
+        free(ptr);
+    }
+    else if((uint8_t*)ptr >= arena->base && (uint8_t*)ptr < arena->base + arena->capacity)
+    {
+        arena->top = (size_t)((uint8_t*)ptr - arena->base); // everything allocated after ptr is gone already
+    }
+    else
+    {
+        uint8_t* mem = (uint8_t*)ptr - 16;
+        arena->spilled -= *(size_t*)mem;
+        free(mem);
+    }
+}
+
+// Makes GIF_TEMP_MALLOC use the arena on this thread until GifLeaveArena is called with the returned value.
+GifArena* GifEnterArena( GifArena* arena )
+{
+    // grow while nothing is allocated from the arena
+    if(arena->top == 0 && arena->peak > arena->capacity)
+    {
+        GifArenaFree(arena);
+        arena->base = (uint8_t*)GIF_MALLOC(arena->peak);
+        arena->capacity = arena->peak;
+#ifndef NDEBUG
+        ++arena->heapAllocs;
+#endif
+    }
+
+    GifArena* previous = GifCurrentArena();
+    GifCurrentArena() = arena;
+    return previous;
+}
+
+void GifLeaveArena( GifArena* previous )
+{
+    GifCurrentArena() = previous;
+}
+
 struct GifPalette
 {
     int bitDepth;
@@ -135,6 +269,70 @@ void GifGetClosestPaletteColor(GifPalette* pPal, int r, int g, int b, int& bestI
     }
 }
 
+// Remembers which palette entry the k-d tree picked for every color seen so far, so that
+// repeated colors (most of a screen capture) cost a single hash probe instead of a tree walk.
+// The result is exactly the same as GifGetClosestPaletteColor.
+// Entries are tagged with a generation number, so starting over for a new palette is O(1)
+// and the table only needs to be cleared every 255 palettes.
+static const int kGifColorCacheBits = 16;
+static const int kGifColorCacheProbes = 8;
+
+struct GifColorCache
+{
+    uint8_t generation;
+
+    uint32_t keys[1 << kGifColorCacheBits];   // generation << 24 | rgb
+    uint8_t inds[1 << kGifColorCacheBits];
+};
+
+// forget every cached color, call this whenever the palette changes
+void GifResetColorCache(GifColorCache* pCache)
+{
+    if(++pCache->generation == 0)
+    {
+        memset(pCache->keys, 0, sizeof(pCache->keys));
+        pCache->generation = 1;
+    }
+}
+
+// picks the palette entry for a color, going through the cache if there is one
+int GifLookupPaletteColor(GifPalette* pPal, GifColorCache* pCache, int r, int g, int b)
+{
+    int bestInd = kGifTransIndex;
+    int bestDiff = 1000000;
+
+    // dithering can push the wanted color out of range, those are rare enough to always search
+    if(!pCache || r > 255 || g > 255 || b > 255)
+    {
+        GifGetClosestPaletteColor(pPal, r, g, b, bestInd, bestDiff);
+        return bestInd;
+    }
+
+    const uint32_t key = ((uint32_t)pCache->generation << 24) | ((uint32_t)r << 16) | ((uint32_t)g << 8) | (uint32_t)b;
+    uint32_t slot = (key * 2654435761u) >> (32 - kGifColorCacheBits);
+    for(int ii=0; ii<kGifColorCacheProbes; ++ii)
+    {
+        const uint32_t cached = pCache->keys[slot];
+        if(cached == key)
+            return pCache->inds[slot];
+
+        if((cached >> 24) != pCache->generation)
+        {
+            // empty (or stale) slot, the color isn't cached yet
+            GifGetClosestPaletteColor(pPal, r, g, b, bestInd, bestDiff);
+            pCache->keys[slot] = key;
+            pCache->inds[slot] = (uint8_t)bestInd;
+            return bestInd;
+        }
+
+        slot = (slot + 1) & ((1 << kGifColorCacheBits) - 1);
+    }
+
+    // too many collisions, don't bother caching this one
+    GifGetClosestPaletteColor(pPal, r, g, b, bestInd, bestDiff);
+    return bestInd;
+}
+
 void GifSwapPixels(uint8_t* image, int pixA, int pixB)
 {
     uint8_t rA = image[pixA*4];
@@ -321,14 +519,55 @@ void GifSplitPalette(uint8_t* image, int numPixels, int firstElt, int lastElt, i
     GifSplitPalette(image+subPixelsA*4, subPixelsB, splitElt, lastElt,  splitElt+splitDist, splitDist/2, treeNode*2+1, buildForDither, pal);
 }
 
-// Finds all pixels that have changed from the previous image and
-// moves them to the fromt of th buffer.
-// This allows us to build a palette optimized for the colors of the
-// changed pixels only.
-int GifPickChangedPixels( const uint8_t* lastFrame, uint8_t* frame, int numPixels )
+enum GifSimdLevel
+{
+    GifSimdNone,
+    GifSimdSSE2,
+    GifSimdAVX2
+};
+
+// the best instruction set the CPU (and the OS) supports for the frame differencing
+int GifDetectSimd()
+{
+#if defined(GIF_AVX2) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return GifSimdAVX2;
+#elif defined(GIF_AVX2)
+    int info[4];
+    __cpuid(info, 0);
+    if(info[0] >= 7)
+    {
+        __cpuid(info, 1);
+        const bool osUsesXsave = (info[2] & (1 << 27)) != 0;
+        const bool hasAvx = (info[2] & (1 << 28)) != 0;
+        __cpuidex(info, 7, 0);
+        const bool hasAvx2 = (info[1] & (1 << 5)) != 0;
+        if(osUsesXsave && hasAvx && hasAvx2 && (_xgetbv(0) & 6) == 6)
+            return GifSimdAVX2;
+    }
+#endif
+#ifdef GIF_SSE2
+    return GifSimdSSE2;
+#else
+    return GifSimdNone;
+#endif
+}
+
+int GifCountBits(uint32_t bits)
+{
+    bits = bits - ((bits >> 1) & 0x55555555);
+    bits = (bits & 0x33333333) + ((bits >> 2) & 0x33333333);
+    return (int)((((bits + (bits >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24);
+}
+
+// Marks the pixels whose color (alpha is ignored) differs between the two frames,
+// one bit per pixel: pixel ii is bit (ii & 7) of changedMask[ii >> 3].
+// changedMask must hold (numPixels+7)/8 bytes. Returns the number of changed pixels.
+int GifDiffPixelsScalar( const uint8_t* lastFrame, const uint8_t* frame, int numPixels, uint8_t* changedMask )
 {
     int numChanged = 0;
-    uint8_t* writeIter = frame;
+    memset(changedMask, 0, (size_t)(numPixels + 7) / 8);
 
     for (int ii=0; ii<numPixels; ++ii)
     {
@@ -336,11 +575,8 @@ int GifPickChangedPixels( const uint8_t* lastFrame, uint8_t* frame, int numPixel
            lastFrame[1] != frame[1] ||
            lastFrame[2] != frame[2])
         {
-            writeIter[0] = frame[0];
-            writeIter[1] = frame[1];
-            writeIter[2] = frame[2];
+            changedMask[ii >> 3] |= (uint8_t)(1 << (ii & 7));
             ++numChanged;
-            writeIter += 4;
         }
         lastFrame += 4;
         frame += 4;
@@ -349,341 +585,1180 @@ int GifPickChangedPixels( const uint8_t* lastFrame, uint8_t* frame, int numPixel
     return numChanged;
 }
 
-// Creates a palette by placing all the image pixels in a k-d tree and then averaging the blocks at the bottom.
-// This is known as the "modified median split" technique
-void GifMakePalette( const uint8_t* lastFrame, const uint8_t* nextFrame, uint32_t width, uint32_t height, int bitDepth, bool buildForDither, GifPalette* pPal )
+#ifdef GIF_SSE2
+// compares 8 pixels (two registers) per mask byte
+int GifDiffPixelsSSE2( const uint8_t* lastFrame, const uint8_t* frame, int numPixels, uint8_t* changedMask )
 {
-    pPal->bitDepth = bitDepth;
+    const __m128i rgbBits = _mm_set1_epi32(0x00ffffff);
+    const __m128i zero = _mm_setzero_si128();
 
-    // SplitPalette is destructive (it sorts the pixels by color) so
-    // we must create a copy of the image for it to destroy
-    size_t imageSize = (size_t)(width * height * 4 * sizeof(uint8_t));
-    uint8_t* destroyableImage = (uint8_t*)GIF_TEMP_MALLOC(imageSize);
-    memcpy(destroyableImage, nextFrame, imageSize);
-
-    int numPixels = (int)(width * height);
-    if(lastFrame)
-        numPixels = GifPickChangedPixels(lastFrame, destroyableImage, numPixels);
+    int numChanged = 0;
+    int ii = 0;
+    for(; ii+8<=numPixels; ii+=8)
+    {
+        __m128i diffLo = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(lastFrame + ii*4)),
+                                       _mm_loadu_si128((const __m128i*)(frame + ii*4)));
+        __m128i diffHi = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(lastFrame + ii*4 + 16)),
+                                       _mm_loadu_si128((const __m128i*)(frame + ii*4 + 16)));
+        diffLo = _mm_cmpeq_epi32(_mm_and_si128(diffLo, rgbBits), zero);
+        diffHi = _mm_cmpeq_epi32(_mm_and_si128(diffHi, rgbBits), zero);
+
+        const int same = _mm_movemask_ps(_mm_castsi128_ps(diffLo)) | (_mm_movemask_ps(_mm_castsi128_ps(diffHi)) << 4);
+        const uint8_t changed = (uint8_t)~same;
+        changedMask[ii >> 3] = changed;
+        numChanged += GifCountBits(changed);
+    }
 
-    const int lastElt = 1 << bitDepth;
-    const int splitElt = lastElt/2;
-    const int splitDist = splitElt/2;
+    return numChanged + GifDiffPixelsScalar(lastFrame + ii*4, frame + ii*4, numPixels - ii, changedMask + (ii >> 3));
+}
+#endif
 
-    GifSplitPalette(destroyableImage, numPixels, 1, lastElt, splitElt, splitDist, 1, buildForDither, pPal);
+#ifdef GIF_AVX2
+// compares 8 pixels (one register) per mask byte
+GIF_TARGET_AVX2 int GifDiffPixelsAVX2( const uint8_t* lastFrame, const uint8_t* frame, int numPixels, uint8_t* changedMask )
+{
+    const __m256i rgbBits = _mm256_set1_epi32(0x00ffffff);
+    const __m256i zero = _mm256_setzero_si256();
 
-    GIF_TEMP_FREE(destroyableImage);
+    int numChanged = 0;
+    int ii = 0;
+    for(; ii+8<=numPixels; ii+=8)
+    {
+        __m256i diff = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(lastFrame + ii*4)),
+                                        _mm256_loadu_si256((const __m256i*)(frame + ii*4)));
+        diff = _mm256_cmpeq_epi32(_mm256_and_si256(diff, rgbBits), zero);
 
-    // add the bottom node for the transparency index
-    pPal->treeSplit[1 << (bitDepth-1)] = 0;
-    pPal->treeSplitElt[1 << (bitDepth-1)] = 0;
+        const uint8_t changed = (uint8_t)~_mm256_movemask_ps(_mm256_castsi256_ps(diff));
+        changedMask[ii >> 3] = changed;
+        numChanged += GifCountBits(changed);
+    }
 
-    pPal->r[0] = pPal->g[0] = pPal->b[0] = 0;
+    return numChanged + GifDiffPixelsScalar(lastFrame + ii*4, frame + ii*4, numPixels - ii, changedMask + (ii >> 3));
 }
+#endif
 
-// Implements Floyd-Steinberg dithering, writes palette value to alpha
-void GifDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal )
+// GifDiffPixelsScalar with the fastest kernel this machine supports, the output is bit-for-bit the same
+int GifDiffPixels( const uint8_t* lastFrame, const uint8_t* frame, int numPixels, uint8_t* changedMask )
 {
-    int numPixels = (int)(width * height);
-
-    // quantPixels initially holds color*256 for all pixels
-    // The extra 8 bits of precision allow for sub-single-color error values
-    // to be propagated
-    int32_t *quantPixels = (int32_t *)GIF_TEMP_MALLOC(sizeof(int32_t) * (size_t)numPixels * 4);
+    static const int simdLevel = GifDetectSimd();
+    (void)simdLevel; // unused when built with GIF_NO_SIMD
+#ifdef GIF_AVX2
+    if(simdLevel >= GifSimdAVX2)
+        return GifDiffPixelsAVX2(lastFrame, frame, numPixels, changedMask);
+#endif
+#ifdef GIF_SSE2
+    if(simdLevel >= GifSimdSSE2)
+        return GifDiffPixelsSSE2(lastFrame, frame, numPixels, changedMask);
+#endif
+    return GifDiffPixelsScalar(lastFrame, frame, numPixels, changedMask);
+}
 
-    for( int ii=0; ii<numPixels*4; ++ii )
+// Finds all pixels that have changed from the previous image and
+// copies them to the front of outFrame (which may be the frame itself).
+// This allows us to build a palette optimized for the colors of the
+// changed pixels only.
+// changedMask is the output of GifDiffPixels for the two frames, or NULL to compute it here.
+int GifPickChangedPixels( const uint8_t* lastFrame, const uint8_t* frame, uint8_t* outFrame, int numPixels, const uint8_t* changedMask = NULL )
+{
+    uint8_t* ownMask = NULL;
+    if(!changedMask)
     {
-        uint8_t pix = nextFrame[ii];
-        int32_t pix16 = int32_t(pix) * 256;
-        quantPixels[ii] = pix16;
+        ownMask = (uint8_t*)GIF_TEMP_MALLOC((size_t)(numPixels + 7) / 8);
+        GifDiffPixels(lastFrame, frame, numPixels, ownMask);
+        changedMask = ownMask;
     }
 
-    for( uint32_t yy=0; yy<height; ++yy )
+    int numChanged = 0;
+    uint8_t* writeIter = outFrame;
+
+    for (int ii=0; ii<numPixels; ii+=8)
     {
-        for( uint32_t xx=0; xx<width; ++xx )
+        // whole runs of unchanged pixels are skipped a byte at a time
+        uint32_t changed = changedMask[ii >> 3];
+        for (const uint8_t* pix = frame + ii*4; changed; changed >>= 1, pix += 4)
         {
-            int32_t* nextPix = quantPixels + 4*(yy*width+xx);
-            const uint8_t* lastPix = lastFrame? lastFrame + 4*(yy*width+xx) : NULL;
-
-            // Compute the colors we want (rounding to nearest)
-            int32_t rr = (nextPix[0] + 127) / 256;
-            int32_t gg = (nextPix[1] + 127) / 256;
-            int32_t bb = (nextPix[2] + 127) / 256;
-
-            // if it happens that we want the color from last frame, then just write out
-            // a transparent pixel
-            if( lastFrame &&
-               lastPix[0] == rr &&
-               lastPix[1] == gg &&
-               lastPix[2] == bb )
-            {
-                nextPix[0] = rr;
-                nextPix[1] = gg;
-                nextPix[2] = bb;
-                nextPix[3] = kGifTransIndex;
-                continue;
-            }
-
-            int32_t bestDiff = 1000000;
-            int32_t bestInd = kGifTransIndex;
-
-            // Search the palete
-            GifGetClosestPaletteColor(pPal, rr, gg, bb, bestInd, bestDiff);
-
-            // Write the result to the temp buffer
-            int32_t r_err = nextPix[0] - int32_t(pPal->r[bestInd]) * 256;
-            int32_t g_err = nextPix[1] - int32_t(pPal->g[bestInd]) * 256;
-            int32_t b_err = nextPix[2] - int32_t(pPal->b[bestInd]) * 256;
-
-            nextPix[0] = pPal->r[bestInd];
-            nextPix[1] = pPal->g[bestInd];
-            nextPix[2] = pPal->b[bestInd];
-            nextPix[3] = bestInd;
-
-            // Propagate the error to the four adjacent locations
-            // that we haven't touched yet
-            int quantloc_7 = (int)(yy * width + xx + 1);
-            int quantloc_3 = (int)(yy * width + width + xx - 1);
-            int quantloc_5 = (int)(yy * width + width + xx);
-            int quantloc_1 = (int)(yy * width + width + xx + 1);
-
-            if(quantloc_7 < numPixels)
-            {
-                int32_t* pix7 = quantPixels+4*quantloc_7;
-                pix7[0] += GifIMax( -pix7[0], r_err * 7 / 16 );
-                pix7[1] += GifIMax( -pix7[1], g_err * 7 / 16 );
-                pix7[2] += GifIMax( -pix7[2], b_err * 7 / 16 );
-            }
-
-            if(quantloc_3 < numPixels)
-            {
-                int32_t* pix3 = quantPixels+4*quantloc_3;
-                pix3[0] += GifIMax( -pix3[0], r_err * 3 / 16 );
-                pix3[1] += GifIMax( -pix3[1], g_err * 3 / 16 );
-                pix3[2] += GifIMax( -pix3[2], b_err * 3 / 16 );
-            }
-
-            if(quantloc_5 < numPixels)
-            {
-                int32_t* pix5 = quantPixels+4*quantloc_5;
-                pix5[0] += GifIMax( -pix5[0], r_err * 5 / 16 );
-                pix5[1] += GifIMax( -pix5[1], g_err * 5 / 16 );
-                pix5[2] += GifIMax( -pix5[2], b_err * 5 / 16 );
-            }
-
-            if(quantloc_1 < numPixels)
+            if(changed & 1)
             {
-                int32_t* pix1 = quantPixels+4*quantloc_1;
-                pix1[0] += GifIMax( -pix1[0], r_err / 16 );
-                pix1[1] += GifIMax( -pix1[1], g_err / 16 );
-                pix1[2] += GifIMax( -pix1[2], b_err / 16 );
+                writeIter[0] = pix[0];
+                writeIter[1] = pix[1];
+                writeIter[2] = pix[2];
+                ++numChanged;
+                writeIter += 4;
             }
         }
     }
 
-    // Copy the palettized result to the output buffer
-    for( int ii=0; ii<numPixels*4; ++ii )
-    {
-        outFrame[ii] = (uint8_t)quantPixels[ii];
-    }
+    if(ownMask)
+        GIF_TEMP_FREE(ownMask);
 
-    GIF_TEMP_FREE(quantPixels);
+    return numChanged;
 }
 
-// Picks palette colors for the image using simple thresholding, no dithering
-void GifThresholdImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal )
+// The histogram quantizer counts the colors of a frame at 5 bits per channel in one pass and
+// runs the same median split as GifSplitPalette over the 32768 bins instead of the pixels,
+// so it needs no copy of the frame. Each bin keeps the sum of its exact colors, the palette
+// entries are averages of the real colors, not of the bin centers.
+enum GifQuantizer
 {
-    uint32_t numPixels = width*height;
-    for( uint32_t ii=0; ii<numPixels; ++ii )
-    {
-        // if a previous color is available, and it matches the current color,
-        // set the pixel to transparent
-        if(lastFrame &&
-           lastFrame[0] == nextFrame[0] &&
-           lastFrame[1] == nextFrame[1] &&
-           lastFrame[2] == nextFrame[2])
-        {
-            outFrame[0] = lastFrame[0];
-            outFrame[1] = lastFrame[1];
-            outFrame[2] = lastFrame[2];
-            outFrame[3] = kGifTransIndex;
-        }
-        else
-        {
-            // palettize the pixel
-            int32_t bestDiff = 1000000;
-            int32_t bestInd = 1;
-            GifGetClosestPaletteColor(pPal, nextFrame[0], nextFrame[1], nextFrame[2], bestInd, bestDiff);
-
-            // Write the resulting color to the output buffer
-            outFrame[0] = pPal->r[bestInd];
-            outFrame[1] = pPal->g[bestInd];
-            outFrame[2] = pPal->b[bestInd];
-            outFrame[3] = (uint8_t)bestInd;
-        }
+    GifQuantizeMedianSplit,         // GifSplitPalette over every (changed) pixel, the original
+    GifQuantizeHistogram,           // median split over the color histogram
+    GifQuantizeHistogramSampled     // the same, from every kGifHistogramSampleStep-th pixel only
+};
 
-        if(lastFrame) lastFrame += 4;
-        outFrame += 4;
-        nextFrame += 4;
-    }
-}
+static const int kGifHistogramBits = 5;
+static const int kGifHistogramSize = 1 << (3*kGifHistogramBits);
+static const uint32_t kGifHistogramSampleStep = 4;
 
-// Simple structure to write out the LZW-compressed portion of the image
-// one bit at a time
-struct GifBitStatus
+struct GifColorBin
 {
-    uint8_t bitIndex;  // how many bits in the partial byte written so far
-    uint8_t byte;      // current partial byte
-
-    uint32_t chunkIndex;
-    uint8_t chunk[256];   // bytes are written in here until we have 256 of them, then written to the file
+    uint32_t count;
+    uint64_t r, g, b;   // sums of the exact colors that fell into this bin
 };
 
-// insert a single bit
-void GifWriteBit( GifBitStatus& stat, uint32_t bit )
+int GifHistogramCoord(int binIndex, int com)
 {
-    bit = bit & 1;
-    bit = bit << stat.bitIndex;
-    stat.byte |= bit;
+    return (binIndex >> ((2-com)*kGifHistogramBits)) & ((1 << kGifHistogramBits) - 1);
+}
 
-    ++stat.bitIndex;
-    if( stat.bitIndex > 7 )
+// Counts every step-th pixel from firstPixel on, only those set in changedMask if there is one.
+void GifAddToHistogram( GifColorBin* bins, const uint8_t* image, uint32_t numPixels, uint32_t firstPixel, uint32_t step, const uint8_t* changedMask )
+{
+    const int shift = 8 - kGifHistogramBits;
+    for(uint32_t ii=firstPixel; ii<numPixels; ii+=step)
     {
-        // move the newly-finished byte to the chunk buffer
-        stat.chunk[stat.chunkIndex++] = stat.byte;
-        // and start a new byte
-        stat.bitIndex = 0;
-        stat.byte = 0;
+        if(changedMask && !(changedMask[ii >> 3] & (1 << (ii & 7))))
+            continue;
+
+        const uint8_t* pix = image + ii*4;
+        GifColorBin& bin = bins[((pix[0] >> shift) << (2*kGifHistogramBits)) | ((pix[1] >> shift) << kGifHistogramBits) | (pix[2] >> shift)];
+        ++bin.count;
+        bin.r += pix[0];
+        bin.g += pix[1];
+        bin.b += pix[2];
     }
 }
 
-// write all bytes so far to the file
-void GifWriteChunk( FILE* f, GifBitStatus& stat )
+// GifSplitPalette for a list of occupied histogram bins.
+// A node is split at a bin boundary, so every color on the left is below treeSplit and every
+// color on the right at or above it, which is all GifGetClosestPaletteColor relies on.
+void GifSplitHistogram(const GifColorBin* bins, uint16_t* binIndices, int numBins, int firstElt, int lastElt, int splitElt, int splitDist, int treeNode, bool buildForDither, GifPalette* pal)
 {
-    fputc((int)stat.chunkIndex, f);
-    fwrite(stat.chunk, 1, stat.chunkIndex, f);
-
-    stat.bitIndex = 0;
-    stat.byte = 0;
-    stat.chunkIndex = 0;
-}
+    if(lastElt <= firstElt || numBins == 0)
+        return;
 
-void GifWriteCode( FILE* f, GifBitStatus& stat, uint32_t code, uint32_t length )
-{
-    for( uint32_t ii=0; ii<length; ++ii )
+    // base case, bottom of the tree
+    if(lastElt == firstElt+1)
     {
-        GifWriteBit(stat, code);
-        code = code >> 1;
-
-        if( stat.chunkIndex == 255 )
+        if(buildForDither && (firstElt == 1 || firstElt == (1 << pal->bitDepth)-1))
         {
-            GifWriteChunk(f, stat);
-        }
+            // Dithering needs at least one color as dark as anything in the image and
+            // at least one brightest color, see GifSplitPalette. The bin edges are used,
+            // they are at most a few steps darker (or lighter) than the real extremes.
+            const bool darkest = (firstElt == 1);
+            const int edge = darkest? 0 : (1 << (8 - kGifHistogramBits)) - 1;
+            int extreme[3];
+            for(int com=0; com<3; ++com)
+            {
+                extreme[com] = darkest? 255 : 0;
+                for(int ii=0; ii<numBins; ++ii)
+                {
+                    int value = (GifHistogramCoord(binIndices[ii], com) << (8 - kGifHistogramBits)) + edge;
+                    extreme[com] = darkest? GifIMin(extreme[com], value) : GifIMax(extreme[com], value);
+                }
+            }
+
+            pal->r[firstElt] = (uint8_t)extreme[0];
+            pal->g[firstElt] = (uint8_t)extreme[1];
+            pal->b[firstElt] = (uint8_t)extreme[2];
+
+            return;
+        }
+
+        // otherwise, take the average of all colors in these bins
+        uint64_t r=0, g=0, b=0, count=0;
+        for(int ii=0; ii<numBins; ++ii)
+        {
+            const GifColorBin& bin = bins[binIndices[ii]];
+            r += bin.r;
+            g += bin.g;
+            b += bin.b;
+            count += bin.count;
+        }
+
+        pal->r[firstElt] = (uint8_t)((r + count/2) / count);
+        pal->g[firstElt] = (uint8_t)((g + count/2) / count);
+        pal->b[firstElt] = (uint8_t)((b + count/2) / count);
+
+        return;
+    }
+
+    // Find the axis with the largest range
+    int minCoord[3] = { 255, 255, 255 };
+    int maxCoord[3] = { 0, 0, 0 };
+    uint64_t totalCount = 0;
+    for(int ii=0; ii<numBins; ++ii)
+    {
+        for(int com=0; com<3; ++com)
+        {
+            int coord = GifHistogramCoord(binIndices[ii], com);
+            minCoord[com] = GifIMin(minCoord[com], coord);
+            maxCoord[com] = GifIMax(maxCoord[com], coord);
+        }
+        totalCount += bins[binIndices[ii]].count;
+    }
+
+    int rRange = maxCoord[0] - minCoord[0];
+    int gRange = maxCoord[1] - minCoord[1];
+    int bRange = maxCoord[2] - minCoord[2];
+
+    int splitCom = 1;
+    if(bRange > gRange) splitCom = 2;
+    if(rRange > bRange && rRange > gRange) splitCom = 0;
+
+    int splitCoord = maxCoord[splitCom];
+    if(minCoord[splitCom] < maxCoord[splitCom])
+    {
+        // the weighted median along that axis, keeping at least one bin on each side
+        uint64_t axisCounts[1 << kGifHistogramBits] = { 0 };
+        for(int ii=0; ii<numBins; ++ii)
+            axisCounts[GifHistogramCoord(binIndices[ii], splitCom)] += bins[binIndices[ii]].count;
+
+        const uint64_t countA = totalCount * (uint64_t)(splitElt - firstElt) / (uint64_t)(lastElt - firstElt);
+        uint64_t below = axisCounts[minCoord[splitCom]];
+        splitCoord = minCoord[splitCom] + 1;
+        while(splitCoord < maxCoord[splitCom] && below < countA)
+            below += axisCounts[splitCoord++];
+
+        // Take the bin boundary nearest to the median. A big flat background is usually the
+        // median itself, and going past it would leave the other colors only a few entries.
+        const uint64_t belowPrev = below - axisCounts[splitCoord-1];
+        if(splitCoord-1 > minCoord[splitCom] && below > countA && countA - belowPrev < below - countA)
+            --splitCoord;
+    }
+
+    // partition the bins, the left side gets everything below splitCoord
+    int numBinsA = 0;
+    for(int ii=0; ii<numBins; ++ii)
+    {
+        if(GifHistogramCoord(binIndices[ii], splitCom) < splitCoord)
+        {
+            uint16_t tmp = binIndices[numBinsA];
+            binIndices[numBinsA++] = binIndices[ii];
+            binIndices[ii] = tmp;
+        }
+    }
+
+    pal->treeSplitElt[treeNode] = (uint8_t)splitCom;
+    pal->treeSplit[treeNode] = (uint8_t)(splitCoord << (8 - kGifHistogramBits));
+
+    if(numBinsA == 0)
+    {
+        // a single color is left, it fills both halves
+        GifSplitHistogram(bins, binIndices, numBins, firstElt, splitElt, splitElt-splitDist, splitDist/2, treeNode*2,   buildForDither, pal);
+        GifSplitHistogram(bins, binIndices, numBins, splitElt, lastElt,  splitElt+splitDist, splitDist/2, treeNode*2+1, buildForDither, pal);
+        return;
+    }
+
+    GifSplitHistogram(bins, binIndices,           numBinsA,         firstElt, splitElt, splitElt-splitDist, splitDist/2, treeNode*2,   buildForDither, pal);
+    GifSplitHistogram(bins, binIndices+numBinsA,  numBins-numBinsA, splitElt, lastElt,  splitElt+splitDist, splitDist/2, treeNode*2+1, buildForDither, pal);
+}
+
+// Builds the palette for a filled-in histogram, the rest is as in GifMakePalette.
+void GifMakePaletteFromHistogram( const GifColorBin* bins, int bitDepth, bool buildForDither, GifPalette* pPal )
+{
+    pPal->bitDepth = bitDepth;
+
+    uint16_t* binIndices = (uint16_t*)GIF_TEMP_MALLOC(sizeof(uint16_t)*kGifHistogramSize);
+    int numBins = 0;
+    for(int ii=0; ii<kGifHistogramSize; ++ii)
+    {
+        if(bins[ii].count)
+            binIndices[numBins++] = (uint16_t)ii;
+    }
+
+    const int lastElt = 1 << bitDepth;
+    const int splitElt = lastElt/2;
+    const int splitDist = splitElt/2;
+
+    GifSplitHistogram(bins, binIndices, numBins, 1, lastElt, splitElt, splitDist, 1, buildForDither, pPal);
+
+    GIF_TEMP_FREE(binIndices);
+
+    // add the bottom node for the transparency index
+    pPal->treeSplit[1 << (bitDepth-1)] = 0;
+    pPal->treeSplitElt[1 << (bitDepth-1)] = 0;
+
+    pPal->r[0] = pPal->g[0] = pPal->b[0] = 0;
+}
+
+// GifMakePalette for the histogram quantizers
+void GifMakePaletteHistogram( const uint8_t* lastFrame, const uint8_t* nextFrame, uint32_t width, uint32_t height, int bitDepth, bool buildForDither, GifPalette* pPal, const uint8_t* changedMask, uint32_t sampleStep )
+{
+    const uint32_t numPixels = width*height;
+
+    uint8_t* ownMask = NULL;
+    if(lastFrame && !changedMask)
+    {
+        ownMask = (uint8_t*)GIF_TEMP_MALLOC((numPixels + 7) / 8);
+        GifDiffPixels(lastFrame, nextFrame, (int)numPixels, ownMask);
+        changedMask = ownMask;
+    }
+
+    GifColorBin* bins = (GifColorBin*)GIF_TEMP_MALLOC(sizeof(GifColorBin)*kGifHistogramSize);
+    memset(bins, 0, sizeof(GifColorBin)*kGifHistogramSize);
+
+    GifAddToHistogram(bins, nextFrame, numPixels, 0, sampleStep, lastFrame? changedMask : NULL);
+    GifMakePaletteFromHistogram(bins, bitDepth, buildForDither, pPal);
+
+    GIF_TEMP_FREE(bins);
+    if(ownMask)
+        GIF_TEMP_FREE(ownMask);
+}
+
+// Creates a palette by placing all the image pixels in a k-d tree and then averaging the blocks at the bottom.
+// This is known as the "modified median split" technique
+// changedMask is optional, see GifPickChangedPixels.
+void GifMakePalette( const uint8_t* lastFrame, const uint8_t* nextFrame, uint32_t width, uint32_t height, int bitDepth, bool buildForDither, GifPalette* pPal, const uint8_t* changedMask = NULL, GifQuantizer quantizer = GifQuantizeMedianSplit )
+{
+    if(quantizer != GifQuantizeMedianSplit)
+    {
+        const uint32_t sampleStep = (quantizer == GifQuantizeHistogramSampled)? kGifHistogramSampleStep : 1;
+        GifMakePaletteHistogram(lastFrame, nextFrame, width, height, bitDepth, buildForDither, pPal, changedMask, sampleStep);
+        return;
+    }
+
+    pPal->bitDepth = bitDepth;
+
+    // SplitPalette is destructive (it sorts the pixels by color) so
+    // we must create a copy of the image for it to destroy
+    size_t imageSize = (size_t)(width * height * 4 * sizeof(uint8_t));
+    uint8_t* destroyableImage = (uint8_t*)GIF_TEMP_MALLOC(imageSize);
+
+    int numPixels = (int)(width * height);
+    if(lastFrame)
+        numPixels = GifPickChangedPixels(lastFrame, nextFrame, destroyableImage, numPixels, changedMask);
+    else
+        memcpy(destroyableImage, nextFrame, imageSize);
+
+    const int lastElt = 1 << bitDepth;
+    const int splitElt = lastElt/2;
+    const int splitDist = splitElt/2;
+
+    GifSplitPalette(destroyableImage, numPixels, 1, lastElt, splitElt, splitDist, 1, buildForDither, pPal);
+
+    GIF_TEMP_FREE(destroyableImage);
+
+    // add the bottom node for the transparency index
+    pPal->treeSplit[1 << (bitDepth-1)] = 0;
+    pPal->treeSplitElt[1 << (bitDepth-1)] = 0;
+
+    pPal->r[0] = pPal->g[0] = pPal->b[0] = 0;
+}
+
+static const int kGifSmallPaletteHashBits = 12;
+
+// Looks for a palette of fewer than maxBitDepth bits that holds every color of the frame to within maxError
+// per channel (0 means exactly). Only the pixels set in changedMask count, or all of them if it is NULL.
+// Pixels are then matched to the palette by the sum of the channel differences, which stays within
+// 3*maxError, so a single channel can end up further off than maxError (but never more than that).
+// If there is one, pPal is built with the smallest bit depth that fits and true is returned, otherwise the
+// frame needs the full palette from GifMakePalette. Gives up as soon as it has seen too many colors, so
+// on a busy frame it costs little more than reading a few hundred pixels.
+bool GifMakeSmallPalette( const uint8_t* image, uint32_t numPixels, const uint8_t* changedMask, int maxBitDepth, int maxError, bool buildForDither, GifPalette* pPal )
+{
+    const int maxColors = (1 << (maxBitDepth-1)) - 1; // one less bit, and index 0 is the transparent color
+    if(maxColors < 1)
+        return false;
+
+    uint8_t colors[255*4];
+    int numColors = 0;
+
+    // colors that were seen before, exactly, so most pixels don't have to search the palette
+    const uint32_t hashSize = 1u << kGifSmallPaletteHashBits;
+    uint32_t* seen = (uint32_t*)GIF_TEMP_MALLOC(sizeof(uint32_t) * hashSize);
+    memset(seen, 0, sizeof(uint32_t) * hashSize);
+    uint32_t numSeen = 0;
+
+    bool fits = true;
+    for(uint32_t ii=0; ii<numPixels && fits; ++ii)
+    {
+        if(changedMask && !(changedMask[ii >> 3] & (1 << (ii & 7))))
+        {
+            if(!(ii & 7) && !changedMask[ii >> 3])
+                ii += 7; // skip 8 unchanged pixels at once
+            continue;
+        }
+
+        const uint8_t* pix = image + ii*4;
+        const uint32_t key = (1u << 24) | ((uint32_t)pix[2] << 16) | ((uint32_t)pix[1] << 8) | pix[0];
+        uint32_t slot = (key * 2654435761u) >> (32 - kGifSmallPaletteHashBits);
+        while(seen[slot] && seen[slot] != key)
+            slot = (slot + 1) & (hashSize - 1);
+        if(seen[slot] == key)
+            continue;
+
+        bool found = false;
+        for(int cc=0; cc<numColors && !found; ++cc)
+        {
+            const uint8_t* color = colors + cc*4;
+            found = GifIAbs(color[0] - pix[0]) <= maxError &&
+                    GifIAbs(color[1] - pix[1]) <= maxError &&
+                    GifIAbs(color[2] - pix[2]) <= maxError;
+        }
+        if(!found)
+        {
+            if(numColors == maxColors)
+            {
+                fits = false;
+                break;
+            }
+            memcpy(colors + numColors*4, pix, 4);
+            ++numColors;
+        }
+
+        // keep the table at most 3/4 full, the rest of the colors just search the palette
+        if(numSeen < hashSize/4*3)
+        {
+            seen[slot] = key;
+            ++numSeen;
+        }
+    }
+
+    GIF_TEMP_FREE(seen);
+    if(!fits)
+        return false;
+
+    int bitDepth = 1;
+    while((1 << bitDepth) - 1 < numColors)
+        ++bitDepth;
+
+    // GifSplitPalette gives every leaf exactly one pixel when there are as many pixels as leaves,
+    // so list every color once and fill up with copies of the last one
+    const int numLeaves = (1 << bitDepth) - 1;
+    if(numColors == 0)
+        memset(colors, 0, 4);
+    for(int cc=GifIMax(numColors, 1); cc<numLeaves; ++cc)
+        memcpy(colors + cc*4, colors + (cc-1)*4, 4);
+
+    pPal->bitDepth = bitDepth;
+
+    const int lastElt = 1 << bitDepth;
+    const int splitElt = lastElt/2;
+    const int splitDist = splitElt/2;
+
+    GifSplitPalette(colors, numLeaves, 1, lastElt, splitElt, splitDist, 1, buildForDither, pPal);
+
+    // add the bottom node for the transparency index
+    pPal->treeSplit[1 << (bitDepth-1)] = 0;
+    pPal->treeSplitElt[1 << (bitDepth-1)] = 0;
+
+    pPal->r[0] = pPal->g[0] = pPal->b[0] = 0;
+
+    return true;
+}
+
+// Builds one palette for a whole animation out of a few of its frames, to pass to GifBegin.
+// Every frame contributes every numFrames-th pixel (starting at a different one for each frame),
+// so the palette is built from about one frame's worth of pixels however many frames are sampled.
+void GifMakeGlobalPalette( const uint8_t* const* frames, uint32_t numFrames, uint32_t width, uint32_t height, int bitDepth, bool buildForDither, GifPalette* pPal, GifQuantizer quantizer = GifQuantizeMedianSplit )
+{
+    const uint32_t numPixels = width*height;
+    const uint32_t step = numFrames? numFrames : 1;
+
+    if(quantizer != GifQuantizeMedianSplit)
+    {
+        // the histogram is filled straight from the frames, no need to gather the samples
+        const uint32_t sampleStep = (quantizer == GifQuantizeHistogramSampled)? kGifHistogramSampleStep : 1;
+        GifColorBin* bins = (GifColorBin*)GIF_TEMP_MALLOC(sizeof(GifColorBin)*kGifHistogramSize);
+        memset(bins, 0, sizeof(GifColorBin)*kGifHistogramSize);
+
+        for(uint32_t ff=0; ff<numFrames; ++ff)
+            GifAddToHistogram(bins, frames[ff], numPixels, ff, step*sampleStep, NULL);
+        GifMakePaletteFromHistogram(bins, bitDepth, buildForDither, pPal);
+
+        GIF_TEMP_FREE(bins);
+        return;
+    }
+
+    uint8_t* samples = (uint8_t*)GIF_TEMP_MALLOC((size_t)(numPixels + numFrames) * 4);
+    uint32_t numSamples = 0;
+    for(uint32_t ff=0; ff<numFrames; ++ff)
+    {
+        for(uint32_t ii=ff; ii<numPixels; ii+=step)
+        {
+            memcpy(samples + numSamples*4, frames[ff] + ii*4, 4);
+            ++numSamples;
+        }
+    }
+
+    GifMakePalette(NULL, samples, numSamples, 1, bitDepth, buildForDither, pPal);
+
+    GIF_TEMP_FREE(samples);
+}
+
+// Implements Floyd-Steinberg dithering, writes palette value to alpha
+void GifDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal, GifColorCache* pCache = NULL )
+{
+    int numPixels = (int)(width * height);
+
+    // quantPixels initially holds color*256 for all pixels
+    // The extra 8 bits of precision allow for sub-single-color error values
+    // to be propagated
+    int32_t *quantPixels = (int32_t *)GIF_TEMP_MALLOC(sizeof(int32_t) * (size_t)numPixels * 4);
+
+    for( int ii=0; ii<numPixels*4; ++ii )
+    {
+        uint8_t pix = nextFrame[ii];
+        int32_t pix16 = int32_t(pix) * 256;
+        quantPixels[ii] = pix16;
+    }
+
+    for( uint32_t yy=0; yy<height; ++yy )
+    {
+        for( uint32_t xx=0; xx<width; ++xx )
+        {
+            int32_t* nextPix = quantPixels + 4*(yy*width+xx);
+            const uint8_t* lastPix = lastFrame? lastFrame + 4*(yy*width+xx) : NULL;
+
+            // Compute the colors we want (rounding to nearest)
+            int32_t rr = (nextPix[0] + 127) / 256;
+            int32_t gg = (nextPix[1] + 127) / 256;
+            int32_t bb = (nextPix[2] + 127) / 256;
+
+            // if it happens that we want the color from last frame, then just write out
+            // a transparent pixel
+            if( lastFrame &&
+               lastPix[0] == rr &&
+               lastPix[1] == gg &&
+               lastPix[2] == bb )
+            {
+                nextPix[0] = rr;
+                nextPix[1] = gg;
+                nextPix[2] = bb;
+                nextPix[3] = kGifTransIndex;
+                continue;
+            }
+
+            // Search the palete
+            int32_t bestInd = GifLookupPaletteColor(pPal, pCache, rr, gg, bb);
+
+            // Write the result to the temp buffer
+            int32_t r_err = nextPix[0] - int32_t(pPal->r[bestInd]) * 256;
+            int32_t g_err = nextPix[1] - int32_t(pPal->g[bestInd]) * 256;
+            int32_t b_err = nextPix[2] - int32_t(pPal->b[bestInd]) * 256;
+
+            nextPix[0] = pPal->r[bestInd];
+            nextPix[1] = pPal->g[bestInd];
+            nextPix[2] = pPal->b[bestInd];
+            nextPix[3] = bestInd;
+
+            // Propagate the error to the four adjacent locations
+            // that we haven't touched yet
+            int quantloc_7 = (int)(yy * width + xx + 1);
+            int quantloc_3 = (int)(yy * width + width + xx - 1);
+            int quantloc_5 = (int)(yy * width + width + xx);
+            int quantloc_1 = (int)(yy * width + width + xx + 1);
+
+            if(quantloc_7 < numPixels)
+            {
+                int32_t* pix7 = quantPixels+4*quantloc_7;
+                pix7[0] += GifIMax( -pix7[0], r_err * 7 / 16 );
+                pix7[1] += GifIMax( -pix7[1], g_err * 7 / 16 );
+                pix7[2] += GifIMax( -pix7[2], b_err * 7 / 16 );
+            }
+
+            if(quantloc_3 < numPixels)
+            {
+                int32_t* pix3 = quantPixels+4*quantloc_3;
+                pix3[0] += GifIMax( -pix3[0], r_err * 3 / 16 );
+                pix3[1] += GifIMax( -pix3[1], g_err * 3 / 16 );
+                pix3[2] += GifIMax( -pix3[2], b_err * 3 / 16 );
+            }
+
+            if(quantloc_5 < numPixels)
+            {
+                int32_t* pix5 = quantPixels+4*quantloc_5;
+                pix5[0] += GifIMax( -pix5[0], r_err * 5 / 16 );
+                pix5[1] += GifIMax( -pix5[1], g_err * 5 / 16 );
+                pix5[2] += GifIMax( -pix5[2], b_err * 5 / 16 );
+            }
+
+            if(quantloc_1 < numPixels)
+            {
+                int32_t* pix1 = quantPixels+4*quantloc_1;
+                pix1[0] += GifIMax( -pix1[0], r_err / 16 );
+                pix1[1] += GifIMax( -pix1[1], g_err / 16 );
+                pix1[2] += GifIMax( -pix1[2], b_err / 16 );
+            }
+        }
     }
+
+    // Copy the palettized result to the output buffer
+    for( int ii=0; ii<numPixels*4; ++ii )
+    {
+        outFrame[ii] = (uint8_t)quantPixels[ii];
+    }
+
+    GIF_TEMP_FREE(quantPixels);
+}
+
+// Picks palette colors for the image using simple thresholding, no dithering
+// changedMask is the output of GifDiffPixels for lastFrame and nextFrame, or NULL to compute it here.
+void GifThresholdImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal, GifColorCache* pCache = NULL, const uint8_t* changedMask = NULL )
+{
+    uint32_t numPixels = width*height;
+
+    uint8_t* ownMask = NULL;
+    if(lastFrame && !changedMask)
+    {
+        ownMask = (uint8_t*)GIF_TEMP_MALLOC((numPixels + 7) / 8);
+        GifDiffPixels(lastFrame, nextFrame, (int)numPixels, ownMask);
+        changedMask = ownMask;
+    }
+
+    for( uint32_t ii=0; ii<numPixels; ++ii )
+    {
+        // if a previous color is available, and it matches the current color,
+        // set the pixel to transparent
+        if(lastFrame && !(changedMask[ii >> 3] & (1 << (ii & 7))))
+        {
+            outFrame[0] = lastFrame[0];
+            outFrame[1] = lastFrame[1];
+            outFrame[2] = lastFrame[2];
+            outFrame[3] = kGifTransIndex;
+        }
+        else
+        {
+            // palettize the pixel
+            int32_t bestInd = GifLookupPaletteColor(pPal, pCache, nextFrame[0], nextFrame[1], nextFrame[2]);
+
+            // Write the resulting color to the output buffer
+            outFrame[0] = pPal->r[bestInd];
+            outFrame[1] = pPal->g[bestInd];
+            outFrame[2] = pPal->b[bestInd];
+            outFrame[3] = (uint8_t)bestInd;
+        }
+
+        if(lastFrame) lastFrame += 4;
+        outFrame += 4;
+        nextFrame += 4;
+    }
+
+    if(ownMask)
+        GIF_TEMP_FREE(ownMask);
+}
+
+// How GifQuantizeFrame dithers. Passing a bool still works: true is Floyd-Steinberg.
+enum GifDitherMode
+{
+    GifDitherNone,
+    GifDitherFloydSteinberg,    // error diffusion, smoothest, but serial and 16 bytes of scratch per pixel
+    GifDitherOrdered            // 8x8 Bayer pattern, every pixel on its own so rows can be split across threads
+};
+
+// how far (in color steps) the Bayer pattern pushes a color each way
+static const int kGifOrderedSpread = 32;
+
+// Ordered dithering of rows firstRow to lastRow-1 (all of them if lastRow is 0).
+// Colors that are in the palette exactly are not dithered, so flat areas of a screen capture stay flat.
+// Pixels not set in changedMask (the source pixel is the same as in the last frame) become transparent,
+// which keeps static areas stable from frame to frame whatever the palette does. Without a mask,
+// a pixel is transparent when it comes out the same as in lastFrame, like in GifDitherImage.
+// outFrame may be lastFrame.
+void GifOrderedDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal, GifColorCache* pCache, const uint8_t* changedMask, uint32_t firstRow = 0, uint32_t lastRow = 0 )
+{
+    static const uint8_t bayer[64] =
+    {
+         0, 32,  8, 40,  2, 34, 10, 42,
+        48, 16, 56, 24, 50, 18, 58, 26,
+        12, 44,  4, 36, 14, 46,  6, 38,
+        60, 28, 52, 20, 62, 30, 54, 22,
+         3, 35, 11, 43,  1, 33,  9, 41,
+        51, 19, 59, 27, 49, 17, 57, 25,
+        15, 47,  7, 39, 13, 45,  5, 37,
+        63, 31, 55, 23, 61, 29, 53, 21
+    };
+    int offsets[64];
+    for(int ii=0; ii<64; ++ii)
+        offsets[ii] = (bayer[ii]*2 - 63) * kGifOrderedSpread / 128;
+
+    if(!lastRow) lastRow = height;
+    if(!lastFrame) changedMask = NULL;
+
+    for( uint32_t yy=firstRow; yy<lastRow; ++yy )
+    {
+        const int* rowOffsets = offsets + (yy & 7)*8;
+        for( uint32_t xx=0; xx<width; ++xx )
+        {
+            const uint32_t ii = yy*width+xx;
+            const uint8_t* nextPix = nextFrame + ii*4;
+            uint8_t* outPix = outFrame + ii*4;
+
+            if(changedMask && !(changedMask[ii >> 3] & (1 << (ii & 7))))
+            {
+                const uint8_t* lastPix = lastFrame + ii*4;
+                outPix[0] = lastPix[0];
+                outPix[1] = lastPix[1];
+                outPix[2] = lastPix[2];
+                outPix[3] = kGifTransIndex;
+                continue;
+            }
+
+            const int rr = nextPix[0], gg = nextPix[1], bb = nextPix[2];
+            int bestInd = GifLookupPaletteColor(pPal, pCache, rr, gg, bb);
+            if(pPal->r[bestInd] != rr || pPal->g[bestInd] != gg || pPal->b[bestInd] != bb)
+            {
+                const int offset = rowOffsets[xx & 7];
+                bestInd = GifLookupPaletteColor(pPal, pCache,
+                                                GifIMin(255, GifIMax(0, rr + offset)),
+                                                GifIMin(255, GifIMax(0, gg + offset)),
+                                                GifIMin(255, GifIMax(0, bb + offset)));
+            }
+
+            if(lastFrame && !changedMask)
+            {
+                const uint8_t* lastPix = lastFrame + ii*4;
+                if(lastPix[0] == pPal->r[bestInd] && lastPix[1] == pPal->g[bestInd] && lastPix[2] == pPal->b[bestInd])
+                    bestInd = kGifTransIndex;
+            }
+
+            if(bestInd == kGifTransIndex)
+            {
+                // the color is already on screen
+                const uint8_t* lastPix = lastFrame + ii*4;
+                outPix[0] = lastPix[0];
+                outPix[1] = lastPix[1];
+                outPix[2] = lastPix[2];
+            }
+            else
+            {
+                outPix[0] = pPal->r[bestInd];
+                outPix[1] = pPal->g[bestInd];
+                outPix[2] = pPal->b[bestInd];
+            }
+            outPix[3] = (uint8_t)bestInd;
+        }
+    }
+}
+
+// most threads a frame is split over, so the std::thread objects can live in a fixed array
+static const int kGifMaxThreads = 64;
+
+// A job handed to GifRunParts: part(0) .. part(numParts-1) may run on any thread
+struct GifWorkerJob
+{
+    const std::function<void(int)>* part;
+    int numParts;
+    int nextPart;   // the next one nobody has taken yet
+    int partsDone;
+    GifWorkerJob* next;
+};
+
+// Threads that a writer keeps from frame to frame for the parts of its jobs, so no thread is
+// started or joined per frame. They are only started once a job has parts for them, up to one less
+// than the parts of the largest job, and wait for the next job in between.
+// Several threads may hand in jobs at once (the quantize and write stages of a writer do);
+// the workers take parts in the order the jobs came in.
+struct GifWorkers
+{
+    std::mutex mutex;
+    std::condition_variable wake;       // a job came in, or quit was set
+    std::condition_variable partDone;
+    std::thread threads[kGifMaxThreads-1];
+    int numThreads;                     // started so far
+    bool quit;
+    GifWorkerJob* jobs;                 // jobs with parts nobody has taken yet, oldest first
+};
+
+void GifInitWorkers( GifWorkers* workers )
+{
+    workers->numThreads = 0;
+    workers->quit = false;
+    workers->jobs = NULL;
+}
+
+// Waits for the workers to finish and stops them, GifRunParts may start them again later
+void GifStopWorkers( GifWorkers* workers )
+{
+    {
+        std::lock_guard<std::mutex> lock(workers->mutex);
+        workers->quit = true;
+    }
+    workers->wake.notify_all();
+
+    for(int tt=0; tt<workers->numThreads; ++tt)
+        workers->threads[tt].join();
+    GifInitWorkers(workers);
+}
+
+// Takes the next part of job, called with the mutex held; a job with no parts left leaves the queue
+static int GifTakePart( GifWorkers* workers, GifWorkerJob* job )
+{
+    const int part = job->nextPart++;
+    if(job->nextPart == job->numParts)
+    {
+        GifWorkerJob** link = &workers->jobs;
+        while(*link != job)
+            link = &(*link)->next;
+        *link = job->next;
+    }
+    return part;
+}
+
+static void GifWorkerLoop( GifWorkers* workers )
+{
+    std::unique_lock<std::mutex> lock(workers->mutex);
+    for(;;)
+    {
+        while(!workers->jobs && !workers->quit)
+            workers->wake.wait(lock);
+        if(!workers->jobs)
+            return;
+
+        GifWorkerJob* job = workers->jobs;
+        const int part = GifTakePart(workers, job);
+
+        lock.unlock();
+        (*job->part)(part);
+        lock.lock();
+
+        // the job lives on the stack of the thread that handed it in, which may return right after this
+        if(++job->partsDone == job->numParts)
+            workers->partDone.notify_all();
+    }
+}
+
+// Calls part(0) .. part(numParts-1) on the workers and the calling thread, returns once all are done.
+// The calling thread takes parts of its own job too, so the job gets done even while the workers are
+// busy with another one. Without workers, a set is started for this job alone and stopped again.
+void GifRunParts( GifWorkers* workers, int numParts, const std::function<void(int)>& part )
+{
+    if(numParts <= 1)
+    {
+        if(numParts == 1) part(0);
+        return;
+    }
+
+    if(!workers)
+    {
+        GifWorkers ownWorkers;
+        GifInitWorkers(&ownWorkers);
+        GifRunParts(&ownWorkers, numParts, part);
+        GifStopWorkers(&ownWorkers);
+        return;
+    }
+
+    GifWorkerJob job;
+    job.part = &part;
+    job.numParts = numParts;
+    job.nextPart = 0;
+    job.partsDone = 0;
+    job.next = NULL;
+
+    std::unique_lock<std::mutex> lock(workers->mutex);
+
+    const int threadsNeeded = GifIMin(numParts-1, kGifMaxThreads-1);
+    while(workers->numThreads < threadsNeeded)
+    {
+        workers->threads[workers->numThreads] = std::thread(&Gif_H::GifWorkerLoop, workers);
+        ++workers->numThreads;
+    }
+
+    GifWorkerJob** link = &workers->jobs;
+    while(*link)
+        link = &(*link)->next;
+    *link = &job;
+    workers->wake.notify_all();
+
+    while(job.nextPart < job.numParts)
+    {
+        const int myPart = GifTakePart(workers, &job);
+        lock.unlock();
+        part(myPart);
+        lock.lock();
+        ++job.partsDone;
+    }
+
+    while(job.partsDone < job.numParts)
+        workers->partDone.wait(lock);
+}
+
+// GifOrderedDitherImage split into bands of rows, at most numThreads of them, run by GifRunParts.
+// If pCache is not NULL it points to numThreads color caches, one for each band.
+// The result is the same as with one thread.
+void GifOrderedDitherParallel( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal, GifColorCache* pCache, const uint8_t* changedMask, int numThreads, GifWorkers* workers = NULL )
+{
+    const int numBands = GifIMax(1, GifIMin(GifIMin(numThreads, kGifMaxThreads), (int)height / 16));
+    if(numBands == 1)
+    {
+        GifOrderedDitherImage(lastFrame, nextFrame, outFrame, width, height, pPal, pCache, changedMask);
+        return;
+    }
+
+    GifRunParts(workers, numBands, [&](int band)
+    {
+        const uint32_t firstRow = height * (uint32_t)band / (uint32_t)numBands;
+        const uint32_t lastRow = height * (uint32_t)(band+1) / (uint32_t)numBands;
+        GifOrderedDitherImage(lastFrame, nextFrame, outFrame, width, height, pPal, pCache? pCache + band : NULL, changedMask, firstRow, lastRow);
+    });
+}
+
+// Picks palette colors for the image, with or without dithering (a GifDitherMode)
+// With GifDitherOrdered and more than one thread, pCache has to hold numThreads caches (see GifOrderedDitherParallel).
+void GifPalettizeImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, int dither, GifPalette* pPal, GifColorCache* pCache, const uint8_t* changedMask, int numThreads = 1, GifWorkers* workers = NULL )
+{
+    if(dither == GifDitherOrdered)
+        GifOrderedDitherParallel(lastFrame, nextFrame, outFrame, width, height, pPal, pCache, changedMask, numThreads, workers);
+    else if(dither)
+        GifDitherImage(lastFrame, nextFrame, outFrame, width, height, pPal, pCache);
+    else
+        GifThresholdImage(lastFrame, nextFrame, outFrame, width, height, pPal, pCache, changedMask);
+}
+
+// Simple structure to write out the LZW-compressed portion of the image
+// one bit at a time
+// A GIF frame is assembled in memory and written to the file with a single fwrite.
+// The buffer is sized up front by the caller, nothing checks for overflow while writing.
+struct GifBuffer
+{
+    uint8_t* data;
+    size_t size;        // bytes written so far
+    size_t capacity;
+};
+
+void GifBufferPut( GifBuffer& buf, uint32_t byte )
+{
+    buf.data[buf.size++] = (uint8_t)byte;
+}
+
+// 16-bit values are little-endian in a GIF
+void GifBufferPutShort( GifBuffer& buf, uint32_t value )
+{
+    buf.data[buf.size++] = (uint8_t)(value & 0xff);
+    buf.data[buf.size++] = (uint8_t)((value >> 8) & 0xff);
+}
+
+void GifBufferPutBytes( GifBuffer& buf, const void* bytes, size_t count )
+{
+    memcpy(buf.data + buf.size, bytes, count);
+    buf.size += count;
 }
 
-// The LZW dictionary is a 256-ary tree constructed as the file is encoded,
-// this is one node
-struct GifLzwNode
+// The LZW codes are packed into a plain byte array first and cut into 255-byte sub-blocks at the end,
+// which also lets separately compressed parts of an image be joined, see GifLzwCompress.
+struct GifBitStatus
 {
-    uint16_t m_next[256];
+    uint64_t bits;      // codes not yet moved to data, lowest bit first
+    uint32_t bitCount;  // how many of them are valid
+
+    uint8_t* data;      // the packed codes, must have room for all of them (plus 4 bytes)
+    size_t size;
 };
 
-// write a 256-color (8-bit) image palette to the file
-void GifWritePalette( const GifPalette* pPal, FILE* f )
+void GifWriteCode( GifBitStatus& stat, uint32_t code, uint32_t length )
 {
-    fputc(0, f);  // first color: transparency
-    fputc(0, f);
-    fputc(0, f);
+    stat.bits |= (uint64_t)code << stat.bitCount;
+    stat.bitCount += length;
 
-    for(int ii=1; ii<(1 << pPal->bitDepth); ++ii)
+    // codes are at most 12 bits, so the accumulator never holds more than 43
+    if( stat.bitCount >= 32 )
+    {
+        uint8_t* dst = stat.data + stat.size;
+        dst[0] = (uint8_t)stat.bits;
+        dst[1] = (uint8_t)(stat.bits >> 8);
+        dst[2] = (uint8_t)(stat.bits >> 16);
+        dst[3] = (uint8_t)(stat.bits >> 24);
+        stat.size += 4;
+        stat.bits >>= 32;
+        stat.bitCount -= 32;
+    }
+}
+
+// move the whole bytes left in the accumulator to data, at most 7 bits stay behind
+void GifFlushCodes( GifBitStatus& stat )
+{
+    while( stat.bitCount >= 8 )
     {
-        uint32_t r = pPal->r[ii];
-        uint32_t g = pPal->g[ii];
-        uint32_t b = pPal->b[ii];
+        stat.data[stat.size++] = (uint8_t)stat.bits;
+        stat.bits >>= 8;
+        stat.bitCount -= 8;
+    }
+}
 
-        fputc((int)r, f);
-        fputc((int)g, f);
-        fputc((int)b, f);
+// append the codes of another GifBitStatus (already flushed) at the current bit position
+void GifAppendCodes( GifBitStatus& stat, const GifBitStatus& other )
+{
+    if( stat.bitCount == 0 )
+    {
+        memcpy(stat.data + stat.size, other.data, other.size);
+        stat.size += other.size;
+    }
+    else
+    {
+        for( size_t ii=0; ii<other.size; ++ii )
+            GifWriteCode(stat, other.data[ii], 8);
     }
+
+    GifWriteCode(stat, (uint32_t)other.bits, other.bitCount);
+    GifFlushCodes(stat);
 }
 
-// write the image header, LZW-compress and write out the image
-void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uint32_t width, uint32_t height, uint32_t delay, GifPalette* pPal)
+// pad the last partial byte with zeros and write everything out as sub-blocks
+void GifFinishCodes( GifBuffer& out, GifBitStatus& stat )
 {
-    // graphics control extension
-    fputc(0x21, f);
-    fputc(0xf9, f);
-    fputc(0x04, f);
-    fputc(0x05, f); // leave prev frame in place, this frame has transparency
-    fputc(delay & 0xff, f);
-    fputc((delay >> 8) & 0xff, f);
-    fputc(kGifTransIndex, f); // transparent color index
-    fputc(0, f);
+    GifFlushCodes(stat);
+    if( stat.bitCount )
+    {
+        stat.data[stat.size++] = (uint8_t)stat.bits;
+        stat.bits = 0;
+        stat.bitCount = 0;
+    }
+
+    for( size_t pos=0; pos<stat.size; pos+=255 )
+    {
+        size_t chunkSize = stat.size - pos;
+        if( chunkSize > 255 ) chunkSize = 255;
+
+        GifBufferPut(out, (uint32_t)chunkSize);
+        GifBufferPutBytes(out, stat.data + pos, chunkSize);
+    }
+}
+
+// The LZW dictionary maps (prefix code, next index) to the code of the longer run.
+// It is an open-addressed hash table with room for twice the 4096 codes a GIF can have,
+// 48 KB in all. Every key carries a generation number, so clearing the dictionary
+// when it fills up is just a new generation instead of a memset.
+static const int kGifLzwHashBits = 13;
+static const int kGifLzwHashSize = 1 << kGifLzwHashBits;
+
+struct GifLzwDict
+{
+    uint32_t generation;                // 12 bits, stored above the 20-bit (prefix << 8 | index) of each key
+    uint32_t keys[kGifLzwHashSize];
+    uint16_t codes[kGifLzwHashSize];
+};
+
+void GifLzwClear( GifLzwDict* dict )
+{
+    dict->generation = (dict->generation + 1) & 0xfff;
+    if(dict->generation == 0)
+    {
+        // the generation wrapped, entries from 4096 clears ago would look valid again
+        memset(dict->keys, 0, sizeof(dict->keys));
+        dict->generation = 1;
+    }
+}
+
+uint32_t GifLzwSlot( uint32_t key )
+{
+    return (key * 2654435761u) >> (32 - kGifLzwHashBits);
+}
+
+// the code for the run prefix followed by index, 0 if it is not in the dictionary
+uint32_t GifLzwFind( const GifLzwDict* dict, uint32_t prefix, uint8_t index )
+{
+    const uint32_t key = (dict->generation << 20) | (prefix << 8) | index;
+    for(uint32_t slot = GifLzwSlot(key); ; slot = (slot + 1) & (kGifLzwHashSize - 1))
+    {
+        if(dict->keys[slot] == key)
+            return dict->codes[slot];
+        if((dict->keys[slot] >> 20) != dict->generation)
+            return 0;
+    }
+}
+
+void GifLzwInsert( GifLzwDict* dict, uint32_t prefix, uint8_t index, uint32_t code )
+{
+    const uint32_t key = (dict->generation << 20) | (prefix << 8) | index;
+    uint32_t slot = GifLzwSlot(key);
+    while((dict->keys[slot] >> 20) == dict->generation)
+        slot = (slot + 1) & (kGifLzwHashSize - 1);
+
+    dict->keys[slot] = key;
+    dict->codes[slot] = (uint16_t)code;
+}
 
-    fputc(0x2c, f); // image descriptor block
+// write a 256-color (8-bit) image palette to the output
+void GifWritePalette( GifBuffer& out, const GifPalette* pPal )
+{
+    uint8_t* dst = out.data + out.size;
 
-    fputc(left & 0xff, f);           // corner of image in canvas space
-    fputc((left >> 8) & 0xff, f);
-    fputc(top & 0xff, f);
-    fputc((top >> 8) & 0xff, f);
+    dst[0] = 0;  // first color: transparency
+    dst[1] = 0;
+    dst[2] = 0;
 
-    fputc(width & 0xff, f);          // width and height of image
-    fputc((width >> 8) & 0xff, f);
-    fputc(height & 0xff, f);
-    fputc((height >> 8) & 0xff, f);
+    for(int ii=1; ii<(1 << pPal->bitDepth); ++ii)
+    {
+        dst[ii*3]   = pPal->r[ii];
+        dst[ii*3+1] = pPal->g[ii];
+        dst[ii*3+2] = pPal->b[ii];
+    }
 
-    //fputc(0, f); // no local color table, no transparency
-    //fputc(0x80, f); // no local color table, but transparency
+    out.size += (size_t)3 << pPal->bitDepth;
+}
 
-    fputc(0x80 + pPal->bitDepth-1, f); // local color table present, 2 ^ bitDepth entries
-    GifWritePalette(pPal, f);
+// the most bytes GifLzwCompress can pack the codes for this many pixels into
+size_t GifLzwCodesBound( size_t numPixels )
+{
+    // one code per pixel at worst, plus a clear code every time the dictionary fills up and the footer
+    const size_t numCodes = numPixels + numPixels / 256 + 4;
+    return (numCodes * 12 + 7) / 8 + 4;
+}
 
-    const int minCodeSize = pPal->bitDepth;
-    const uint32_t clearCode = 1 << pPal->bitDepth;
+// the most bytes GifEncodeLzwImage can write for an image of this size
+size_t GifLzwImageBound( uint32_t width, uint32_t height )
+{
+    const size_t codeBytes = GifLzwCodesBound((size_t)width * height);
 
-    fputc(minCodeSize, f); // min code size 8 bits
+    const size_t headerBytes = 8 + 10 + 3*256 + 1;   // graphics control, descriptor, palette, min code size
+    return headerBytes + codeBytes + codeBytes / 255 + 2;   // sub-block lengths and the terminator
+}
 
-    GifLzwNode* codetree = (GifLzwNode*)GIF_TEMP_MALLOC(sizeof(GifLzwNode)*4096);
+// LZW-compresses rows firstRow to lastRow-1 of an image into stat.
+// An image can be compressed in several parts (on several threads) and the parts joined with GifAppendCodes.
+// Every part but the first starts with an empty dictionary, every part but the last ends with a clear code
+// instead of the end of the image, so the decoder sees a single code stream.
+// dict is scratch memory for the dictionary, allocated by the caller so that worker threads don't allocate.
+void GifLzwCompress( GifBitStatus& stat, GifLzwDict* dict, const uint8_t* image, uint32_t width, uint32_t firstRow, uint32_t lastRow, uint32_t stride, int minCodeSize, bool firstPart, bool lastPart )
+{
+    const uint32_t clearCode = 1u << minCodeSize;
 
-    memset(codetree, 0, sizeof(GifLzwNode)*4096);
+    memset(dict, 0, sizeof(GifLzwDict));
+    GifLzwClear(dict);
     int32_t curCode = -1;
     uint32_t codeSize = (uint32_t)minCodeSize + 1;
     uint32_t maxCode = clearCode+1;
 
-    GifBitStatus stat;
-    stat.byte = 0;
-    stat.bitIndex = 0;
-    stat.chunkIndex = 0;
-
-    GifWriteCode(f, stat, clearCode, codeSize);  // start with a fresh LZW dictionary
+    if(firstPart)
+        GifWriteCode(stat, clearCode, codeSize);  // start with a fresh LZW dictionary
 
-    for(uint32_t yy=0; yy<height; ++yy)
+    for(uint32_t yy=firstRow; yy<lastRow; ++yy)
     {
         for(uint32_t xx=0; xx<width; ++xx)
         {
-            uint8_t nextValue = image[(yy*width+xx)*4+3];
+            uint8_t nextValue = image[(yy*stride+xx)*4+3];
 
             // "loser mode" - no compression, every single code is followed immediately by a clear
-            //WriteCode( f, stat, nextValue, codeSize );
-            //WriteCode( f, stat, 256, codeSize );
+            //WriteCode( stat, nextValue, codeSize );
+            //WriteCode( stat, 256, codeSize );
 
             if( curCode < 0 )
             {
                 // first value in a new run
                 curCode = nextValue;
             }
-            else if( codetree[curCode].m_next[nextValue] )
+            else if( uint32_t nextCode = GifLzwFind(dict, (uint32_t)curCode, nextValue) )
             {
                 // current run already in the dictionary
-                curCode = codetree[curCode].m_next[nextValue];
+                curCode = (int32_t)nextCode;
             }
             else
             {
                 // finish the current run, write a code
-                GifWriteCode(f, stat, (uint32_t)curCode, codeSize);
+                GifWriteCode(stat, (uint32_t)curCode, codeSize);
 
                 // insert the new run into the dictionary
-                codetree[curCode].m_next[nextValue] = (uint16_t)++maxCode;
+                GifLzwInsert(dict, (uint32_t)curCode, nextValue, ++maxCode);
 
                 if( maxCode >= (1ul << codeSize) )
                 {
@@ -694,9 +1769,9 @@ void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uin
                 if( maxCode == 4095 )
                 {
                     // the dictionary is full, clear it out and begin anew
-                    GifWriteCode(f, stat, clearCode, codeSize); // clear tree
+                    GifWriteCode(stat, clearCode, codeSize); // clear tree
 
-                    memset(codetree, 0, sizeof(GifLzwNode)*4096);
+                    GifLzwClear(dict);
                     codeSize = (uint32_t)(minCodeSize + 1);
                     maxCode = clearCode+1;
                 }
@@ -706,33 +1781,327 @@ void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uin
         }
     }
 
-    // compression footer
-    GifWriteCode(f, stat, (uint32_t)curCode, codeSize);
-    GifWriteCode(f, stat, clearCode, codeSize);
-    GifWriteCode(f, stat, clearCode + 1, (uint32_t)minCodeSize + 1);
+    // finish the last run
+    GifWriteCode(stat, (uint32_t)curCode, codeSize);
+
+    if(lastPart)
+    {
+        // compression footer
+        GifWriteCode(stat, clearCode, codeSize);
+        GifWriteCode(stat, clearCode + 1, (uint32_t)minCodeSize + 1);
+    }
+    else
+    {
+        // On reading that last code the decoder adds one more entry to its dictionary (unless it is
+        // the first code after a clear) and may need a bit more per code already. The next part must
+        // start with the decoder at a clear code, so it has to be written at the decoder's width.
+        if( maxCode > clearCode+1 && maxCode+1 >= (1ul << codeSize) && codeSize < 12 )
+            codeSize++;
+        GifWriteCode(stat, clearCode, codeSize);
+    }
+
+    GifFlushCodes(stat);
+}
+
+// the smallest number of pixels worth compressing on a thread of its own
+static const uint32_t kGifLzwMinPartPixels = 1 << 16;
+
+struct GifLzwPart
+{
+    GifBitStatus stat;
+    uint32_t firstRow;
+    uint32_t lastRow;
+};
+
+// write the image header, LZW-compress the image into out
+// out must have room for GifLzwImageBound(width, height) more bytes
+// image points at the top left pixel of the sub-image, rows are stride pixels apart (0 means width)
+// With localPalette false the frame uses the global color table written by GifBegin, pPal must be that palette.
+// Large images are cut into bands of rows (at most numThreads) that are compressed by GifRunParts and
+// joined into one code stream. The file is a bit larger (a clear code and a fresh dictionary per band)
+// and its bytes depend on the number of bands, so it is not the same file as with one thread,
+// but it decodes to exactly the same image.
+void GifEncodeLzwImage(GifBuffer& out, const uint8_t* image, uint32_t left, uint32_t top,  uint32_t width, uint32_t height, uint32_t delay, const GifPalette* pPal, uint32_t stride = 0, bool localPalette = true, int numThreads = 1, GifWorkers* workers = NULL)
+{
+    if(!stride) stride = width;
+
+    // graphics control extension
+    GifBufferPut(out, 0x21);
+    GifBufferPut(out, 0xf9);
+    GifBufferPut(out, 0x04);
+    GifBufferPut(out, 0x05); // leave prev frame in place, this frame has transparency
+    GifBufferPutShort(out, delay);
+    GifBufferPut(out, kGifTransIndex); // transparent color index
+    GifBufferPut(out, 0);
+
+    GifBufferPut(out, 0x2c); // image descriptor block
+
+    GifBufferPutShort(out, left);           // corner of image in canvas space
+    GifBufferPutShort(out, top);
+
+    GifBufferPutShort(out, width);          // width and height of image
+    GifBufferPutShort(out, height);
+
+    if(localPalette)
+    {
+        GifBufferPut(out, 0x80 + pPal->bitDepth-1); // local color table present, 2 ^ bitDepth entries
+        GifWritePalette(out, pPal);
+    }
+    else
+    {
+        GifBufferPut(out, 0); // no local color table
+    }
+
+    const int minCodeSize = GifIMax(2, pPal->bitDepth); // the format has no 1-bit codes
+
+    GifBufferPut(out, minCodeSize); // min code size 8 bits
+
+    GifBitStatus stat;
+    stat.bits = 0;
+    stat.bitCount = 0;
+    stat.data = (uint8_t*)GIF_TEMP_MALLOC(GifLzwCodesBound((size_t)width * height));
+    stat.size = 0;
+
+    const uint32_t numPixels = width*height;
+    int numParts = GifIMin(GifIMin(numThreads, kGifMaxThreads), (int)(numPixels / kGifLzwMinPartPixels));
+    numParts = GifIMax(1, GifIMin(numParts, (int)height));
+
+    GifLzwDict* dicts = (GifLzwDict*)GIF_TEMP_MALLOC(sizeof(GifLzwDict) * (size_t)numParts);
+
+    if(numParts == 1)
+    {
+        GifLzwCompress(stat, dicts, image, width, 0, height, stride, minCodeSize, true, true);
+    }
+    else
+    {
+        GifLzwPart* parts = (GifLzwPart*)GIF_TEMP_MALLOC(sizeof(GifLzwPart) * (size_t)numParts);
+
+        for(int pp=0; pp<numParts; ++pp)
+        {
+            GifLzwPart& part = parts[pp];
+            part.firstRow = height * (uint32_t)pp / (uint32_t)numParts;
+            part.lastRow = height * (uint32_t)(pp+1) / (uint32_t)numParts;
+
+            part.stat.bits = 0;
+            part.stat.bitCount = 0;
+            part.stat.size = 0;
+            part.stat.data = (pp == 0)? stat.data : (uint8_t*)GIF_TEMP_MALLOC(GifLzwCodesBound((size_t)width * (part.lastRow - part.firstRow)));
+        }
+
+        GifRunParts(workers, numParts, [&](int pp)
+        {
+            GifLzwPart& part = parts[pp];
+            GifLzwCompress(part.stat, dicts + pp, image, width, part.firstRow, part.lastRow, stride, minCodeSize, pp == 0, pp == numParts-1);
+        });
+
+        // the first part was compressed in place, the others are appended to it
+        stat = parts[0].stat;
+        for(int pp=1; pp<numParts; ++pp)
+            GifAppendCodes(stat, parts[pp].stat);
+
+        for(int pp=numParts-1; pp>0; --pp)
+            GIF_TEMP_FREE(parts[pp].stat.data);
+        GIF_TEMP_FREE(parts);
+    }
+
+    GIF_TEMP_FREE(dicts);
+
+    // cut the codes into sub-blocks
+    GifFinishCodes(out, stat);
+
+    GifBufferPut(out, 0); // image block terminator
+
+    GIF_TEMP_FREE(stat.data);
+}
+
+// write the image header, LZW-compress and write out the image
+// The frame is encoded in memory and reaches the file with one fwrite.
+void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uint32_t width, uint32_t height, uint32_t delay, GifPalette* pPal, uint32_t stride = 0, bool localPalette = true, int numThreads = 1, GifWorkers* workers = NULL)
+{
+    GifBuffer out;
+    out.capacity = GifLzwImageBound(width, height);
+    out.data = (uint8_t*)GIF_TEMP_MALLOC(out.capacity);
+    out.size = 0;
+
+    GifEncodeLzwImage(out, image, left, top, width, height, delay, pPal, stride, localPalette, numThreads, workers);
+    fwrite(out.data, 1, out.size, f);
+
+    GIF_TEMP_FREE(out.data);
+}
+
+bool GifRowChanged( const uint8_t* row, uint32_t left, uint32_t right )
+{
+    for(uint32_t xx=left; xx<right; ++xx)
+    {
+        if(row[xx*4+3] != kGifTransIndex)
+            return true;
+    }
+    return false;
+}
+
+// Finds the smallest rectangle holding every pixel of a palettized frame that is not transparent,
+// that is every pixel that differs from the previous frame.
+// Returns false (and a 1x1 rectangle at the corner) if nothing changed at all.
+bool GifChangedRect( const uint8_t* image, uint32_t width, uint32_t height, uint32_t* pLeft, uint32_t* pTop, uint32_t* pWidth, uint32_t* pHeight )
+{
+    uint32_t top = 0, bottom = height;
+    while(top < bottom && !GifRowChanged(image + top*width*4, 0, width))
+        ++top;
+
+    if(top == bottom)
+    {
+        *pLeft = *pTop = 0;
+        *pWidth = *pHeight = 1;
+        return false;
+    }
+
+    while(!GifRowChanged(image + (bottom-1)*width*4, 0, width))
+        --bottom;
+
+    // the rows in between only need to be searched outside the columns found so far
+    uint32_t left = width, right = 0;
+    for(uint32_t yy=top; yy<bottom; ++yy)
+    {
+        const uint8_t* row = image + yy*width*4;
+        if(left > 0 && GifRowChanged(row, 0, left))
+        {
+            uint32_t xx = 0;
+            while(row[xx*4+3] == kGifTransIndex) ++xx;
+            left = xx;
+        }
+        if(right < width && GifRowChanged(row, right, width))
+        {
+            uint32_t xx = width;
+            while(row[(xx-1)*4+3] == kGifTransIndex) --xx;
+            right = xx;
+        }
+    }
+
+    *pLeft = left;
+    *pTop = top;
+    *pWidth = right - left;
+    *pHeight = bottom - top;
+    return true;
+}
+
+// write only the part of a palettized frame that changed, the rest of the canvas stays as it was
+void GifWriteChangedImage(FILE* f, uint8_t* image, uint32_t width, uint32_t height, uint32_t delay, GifPalette* pPal, bool localPalette = true, int numThreads = 1, GifWorkers* workers = NULL)
+{
+    uint32_t left, top, rectWidth, rectHeight;
+    GifChangedRect(image, width, height, &left, &top, &rectWidth, &rectHeight);
+
+    GifWriteLzwImage(f, image + (top*width + left)*4, left, top, rectWidth, rectHeight, delay, pPal, width, localPalette, numThreads, workers);
+}
+
+// Byte order of the frames given to a GifWriter. Nothing in the encoder cares which channel is red and which
+// is blue, so BGRA frames (QImage::Format_RGB32 on little endian machines, Windows bitmaps) are palettized
+// as they are and only the palettes are swapped on their way to the file.
+enum GifChannelOrder
+{
+    GifChannelsRGBA,
+    GifChannelsBGRA
+};
 
-    // write out the last partial chunk
-    while( stat.bitIndex ) GifWriteBit(stat, 0);
-    if( stat.chunkIndex ) GifWriteChunk(f, stat);
+// exchanges red and blue, including in the k-d tree
+void GifSwapRedBlue( GifPalette* pPal )
+{
+    for(int ii=0; ii<256; ++ii)
+    {
+        uint8_t r = pPal->r[ii];
+        pPal->r[ii] = pPal->b[ii];
+        pPal->b[ii] = r;
+    }
+    for(int ii=0; ii<255; ++ii)
+    {
+        if(pPal->treeSplitElt[ii] != 1)
+            pPal->treeSplitElt[ii] = (uint8_t)(2 - pPal->treeSplitElt[ii]);
+    }
+}
 
-    fputc(0, f); // image block terminator
+// Frames with padded rows (stride bytes apart) are copied into packed rows, which is what the rest of the
+// writer works on. Returns image itself if the rows are packed already, as they always are in a QImage
+// with 32 bits per pixel.
+const uint8_t* GifPackRows( const uint8_t* image, uint32_t width, uint32_t height, uint32_t stride, uint8_t** pPacked )
+{
+    *pPacked = NULL;
+    if(!stride || stride == width*4)
+        return image;
 
-    GIF_TEMP_FREE(codetree);
+    *pPacked = (uint8_t*)GIF_TEMP_MALLOC((size_t)width*height*4);
+    for(uint32_t yy=0; yy<height; ++yy)
+        memcpy(*pPacked + (size_t)yy*width*4, image + (size_t)yy*stride, width*4);
+    return *pPacked;
 }
 
+// How GifQuantizeFrame finds the palette entry of each pixel.
+// GifLookupCompare quantizes every frame both ways, keeps the cached result and records
+// the timings and the number of pixels where the two disagree (should always be 0).
+enum GifLookupMode
+{
+    GifLookupTree,
+    GifLookupCache,
+    GifLookupCompare
+};
+
+struct GifLookupStats
+{
+    double treeMs;
+    double cacheMs;
+    uint32_t mismatches;
+};
+
 struct GifWriter
 {
     FILE* f;
     uint8_t* oldImage;
     bool firstFrame;
+
+    GifLookupMode lookupMode;   // may be changed after GifBegin, GifLookupCache by default
+    GifQuantizer quantizer;     // how GifQuantizeFrame builds the palettes, GifQuantizeMedianSplit by default
+    GifColorCache* colorCache;  // numColorCaches of them, GifDitherOrdered needs one per thread
+    int numColorCaches;
+    GifLookupStats lookupStats; // of the last frame
+
+    uint8_t* changedMask;       // GifDiffPixels of the current and previous frame
+    uint8_t* lastSource;        // the last frame as it was passed in, kept for GifDitherOrdered and mergeDuplicates
+    bool haveLastSource;
+    int numThreads;             // GifDitherOrdered and the LZW stage split large frames over this many threads, 1 by default;
+                                // with more than one the file differs from a single-threaded one but decodes the same
+    GifWorkers workers;         // the threads beyond the calling one, started as the frames need them and kept until GifEnd
+
+    bool globalPalette;         // every frame uses palette, written once as the global color table
+    GifPalette palette;
+
+    bool mergeDuplicates;       // frames (nearly) equal to the last written one only extend its delay, false by default
+    uint32_t duplicateThreshold;// with mergeDuplicates, how many pixels may differ for a frame to still count as equal, 0 by default
+    long lastFramePos;          // file offset of the last frame's graphics control extension, -1 before the first frame
+    uint32_t lastDelay;         // delay of that frame as written so far
+
+    GifChannelOrder channelOrder; // of the frames, set by GifBegin
+
+    bool adaptiveBitDepth;      // frames with few (changed) colors get a smaller palette, see GifMakeSmallPalette, false by default
+    int maxColorError;          // with adaptiveBitDepth, how far (per channel) colors may be merged to fit a smaller palette, 0 by default
+
+    GifArena quantizeArena;     // temp memory of GifQuantizeFrame
+    GifArena writeArena;        // temp memory of GifWriteQuantizedFrame, separate so the two can run at the same time
 };
 
+// How often the writer's temp memory came from the heap instead of its arenas (counted in debug builds only).
+// Stays the same from frame to frame once the arenas have grown to what the frames need.
+uint32_t GifHeapAllocs( const GifWriter* writer )
+{
+    return writer->quantizeArena.heapAllocs + writer->writeArena.heapAllocs;
+}
+
 // Creates a gif file.
 // The input GIFWriter is assumed to be uninitialized.
 // The delay value is the time between frames in hundredths of a second - note that not all viewers pay much attention to this value.
-bool GifBegin( GifWriter* writer, const char* filename, uint32_t width, uint32_t height, uint32_t delay, int32_t bitDepth = 8, bool dither = false )
+// If globalPal is given (see GifMakeGlobalPalette) it becomes the global color table and every frame is
+// quantized to it, with no palette of its own. Otherwise each frame gets a local palette.
+// channelOrder is the byte order of every frame passed in later, globalPal is in the same order.
+bool GifBegin( GifWriter* writer, const char* filename, uint32_t width, uint32_t height, uint32_t delay, int32_t bitDepth = 8, int dither = GifDitherNone, const GifPalette* globalPal = NULL, GifChannelOrder channelOrder = GifChannelsRGBA )
 {
-    (void)bitDepth; (void)dither; // Mute "Unused argument" warnings
+    (void)bitDepth; // Mute "Unused argument" warnings
 #if defined(_MSC_VER) && (_MSC_VER >= 1400)
 	writer->f = 0;
     fopen_s(&writer->f, filename, "wb");
@@ -746,71 +2115,321 @@ bool GifBegin( GifWriter* writer, const char* filename, uint32_t width, uint32_t
     // allocate
     writer->oldImage = (uint8_t*)GIF_MALLOC(width*height*4);
 
-    fputs("GIF89a", writer->f);
+    writer->lookupMode = GifLookupCache;
+    writer->quantizer = GifQuantizeMedianSplit;
+    writer->colorCache = (GifColorCache*)GIF_MALLOC(sizeof(GifColorCache));
+    memset(writer->colorCache, 0, sizeof(GifColorCache));
+    GifResetColorCache(writer->colorCache);
+    writer->numColorCaches = 1; // more are allocated once GifDitherOrdered runs on more threads
+    memset(&writer->lookupStats, 0, sizeof(GifLookupStats));
+
+    writer->changedMask = (uint8_t*)GIF_MALLOC((width*height+7)/8);
+    writer->lastSource = NULL; // only allocated if ordered dithering or mergeDuplicates is used
+    writer->haveLastSource = false;
+    writer->numThreads = 1;
+    GifInitWorkers(&writer->workers);
+
+    writer->globalPalette = (globalPal != NULL);
+    if(globalPal)
+        writer->palette = *globalPal;
+
+    writer->mergeDuplicates = false;
+    writer->duplicateThreshold = 0;
+    writer->lastFramePos = -1;
+    writer->lastDelay = 0;
+    writer->channelOrder = channelOrder;
+    writer->adaptiveBitDepth = false;
+    writer->maxColorError = 0;
+
+    // room for what a full frame needs, more is added if a frame asks for it:
+    // the palette is built from a copy of the frame (or a histogram), Floyd-Steinberg needs 16 bytes per pixel
+    const size_t numPixels = (size_t)width*height;
+    const size_t histogramBytes = (sizeof(GifColorBin) + sizeof(uint16_t))*kGifHistogramSize + numPixels/8 + 64;
+    const size_t paletteBytes = (numPixels*4 > histogramBytes)? numPixels*4 : histogramBytes;
+    GifArenaInit(&writer->quantizeArena, (dither == GifDitherFloydSteinberg? numPixels*16 : paletteBytes) + 4096);
+    GifArenaInit(&writer->writeArena, GifLzwImageBound(width, height) + GifLzwCodesBound(numPixels) + sizeof(GifLzwDict) + 4096);
+
+    uint8_t header[64 + 3*256];
+    GifBuffer out;
+    out.data = header;
+    out.size = 0;
+    out.capacity = sizeof(header);
+
+    GifBufferPutBytes(out, "GIF89a", 6);
 
     // screen descriptor
-    fputc(width & 0xff, writer->f);
-    fputc((width >> 8) & 0xff, writer->f);
-    fputc(height & 0xff, writer->f);
-    fputc((height >> 8) & 0xff, writer->f);
-
-    fputc(0xf0, writer->f);  // there is an unsorted global color table of 2 entries
-    fputc(0, writer->f);     // background color
-    fputc(0, writer->f);     // pixels are square (we need to specify this because it's 1989)
-
-    // now the "global" palette (really just a dummy palette)
-    // color 0: black
-    fputc(0, writer->f);
-    fputc(0, writer->f);
-    fputc(0, writer->f);
-    // color 1: also black
-    fputc(0, writer->f);
-    fputc(0, writer->f);
-    fputc(0, writer->f);
+    GifBufferPutShort(out, width);
+    GifBufferPutShort(out, height);
+
+    if(globalPal)
+    {
+        GifBufferPut(out, 0xf0 + globalPal->bitDepth-1);  // unsorted global color table of 2 ^ bitDepth entries
+        GifBufferPut(out, 0);     // background color
+        GifBufferPut(out, 0);     // pixels are square (we need to specify this because it's 1989)
+
+        GifPalette filePal = *globalPal;
+        if(channelOrder == GifChannelsBGRA)
+            GifSwapRedBlue(&filePal);
+        GifWritePalette(out, &filePal);
+    }
+    else
+    {
+        GifBufferPut(out, 0xf0);  // there is an unsorted global color table of 2 entries
+        GifBufferPut(out, 0);     // background color
+        GifBufferPut(out, 0);     // pixels are square (we need to specify this because it's 1989)
+
+        // now the "global" palette (really just a dummy palette)
+        // color 0: black
+        GifBufferPut(out, 0);
+        GifBufferPut(out, 0);
+        GifBufferPut(out, 0);
+        // color 1: also black
+        GifBufferPut(out, 0);
+        GifBufferPut(out, 0);
+        GifBufferPut(out, 0);
+    }
 
     if( delay != 0 )
     {
         // animation header
-        fputc(0x21, writer->f); // extension
-        fputc(0xff, writer->f); // application specific
-        fputc(11, writer->f); // length 11
-        fputs("NETSCAPE2.0", writer->f); // yes, really
-        fputc(3, writer->f); // 3 bytes of NETSCAPE2.0 data
+        GifBufferPut(out, 0x21); // extension
+        GifBufferPut(out, 0xff); // application specific
+        GifBufferPut(out, 11); // length 11
+        GifBufferPutBytes(out, "NETSCAPE2.0", 11); // yes, really
+        GifBufferPut(out, 3); // 3 bytes of NETSCAPE2.0 data
 
-        fputc(1, writer->f); // JUST BECAUSE
-        fputc(0, writer->f); // loop infinitely (byte 0)
-        fputc(0, writer->f); // loop infinitely (byte 1)
+        GifBufferPut(out, 1); // JUST BECAUSE
+        GifBufferPut(out, 0); // loop infinitely (byte 0)
+        GifBufferPut(out, 0); // loop infinitely (byte 1)
 
-        fputc(0, writer->f); // block terminator
+        GifBufferPut(out, 0); // block terminator
     }
 
+    fwrite(out.data, 1, out.size, writer->f);
+
     return true;
 }
 
-// Writes out a new frame to a GIF in progress.
-// The GIFWriter should have been created by GIFBegin.
-// AFAIK, it is legal to use different bit depths for different frames of an image -
-// this may be handy to save bits in animations that don't change much.
-bool GifWriteFrame( GifWriter* writer, const uint8_t* image, uint32_t width, uint32_t height, uint32_t delay, int bitDepth = 8, bool dither = false )
+// GifWriteFrame is split into three stages so that callers can spread an export over several threads:
+// 1. GifMakePalette. When dithering, the palette only depends on the frame itself (pass NULL as lastFrame),
+//    so it can be built for many frames at once; otherwise it needs the previous quantized frame.
+// 2. GifQuantizeFrame. Compares against the previous quantized frame in writer->oldImage and replaces it,
+//    so it has to be called in frame order.
+// 3. GifWriteQuantizedFrame on writer->oldImage (or a copy of it). Appends to the file, so also in frame order,
+//    but it may overlap with quantizing the next frame if it works on a copy.
+// Calling the three stages in this order gives exactly the same file as GifWriteFrame.
+// With writer->mergeDuplicates, check GifIsDuplicateFrame first and call GifExtendDelay instead of the three
+// stages if it is a duplicate. GifExtendDelay rewrites the last frame, so any write in progress must be done.
+
+// Is this frame equal to the last one that was written (up to writer->duplicateThreshold pixels)?
+// Always false unless writer->mergeDuplicates is set. The frames are compared as they were passed in,
+// before quantizing, so skipping a duplicate costs one frame comparison.
+// stride is the distance between rows in bytes, 0 if they are packed.
+bool GifIsDuplicateFrame( GifWriter* writer, const uint8_t* image, uint32_t width, uint32_t height, uint32_t stride = 0 )
+{
+    // only looks at what GifQuantizeFrame keeps, so a write may still be in progress
+    if(!writer->mergeDuplicates || writer->firstFrame || !writer->haveLastSource)
+        return false;
+
+    if(!stride || stride == width*4)
+    {
+        const int numChanged = GifDiffPixels(writer->lastSource, image, (int)(width*height), writer->changedMask);
+        return (uint32_t)numChanged <= writer->duplicateThreshold;
+    }
+
+    // only the count matters, so every row can use the start of the mask
+    uint32_t numChanged = 0;
+    for(uint32_t yy=0; yy<height && numChanged <= writer->duplicateThreshold; ++yy)
+        numChanged += (uint32_t)GifDiffPixels(writer->lastSource + (size_t)yy*width*4, image + (size_t)yy*stride, (int)width, writer->changedMask);
+    return numChanged <= writer->duplicateThreshold;
+}
+
+// Shows the last written frame for delay more hundredths of a second, by rewriting the delay
+// in its graphics control extension. Returns false if there is no frame yet or the delay
+// would no longer fit in 16 bits, in which case the frame has to be written after all.
+bool GifExtendDelay( GifWriter* writer, uint32_t delay )
+{
+    if(!writer->f || writer->lastFramePos < 0)
+        return false;
+
+    const uint32_t newDelay = writer->lastDelay + delay;
+    if(newDelay > 0xffff)
+        return false;
+
+    uint8_t bytes[2] = { (uint8_t)(newDelay & 0xff), (uint8_t)(newDelay >> 8) };
+    fseek(writer->f, writer->lastFramePos + 4, SEEK_SET); // 0x21 0xf9 0x04 flags, then the delay
+    fwrite(bytes, 1, 2, writer->f);
+    fseek(writer->f, 0, SEEK_END);
+
+    writer->lastDelay = newDelay;
+    return true;
+}
+
+// Palettizes a frame into writer->oldImage (the palette index ends up in the alpha channel).
+// If havePalette is true, pPal must have been built the way GifWriteFrame would have built it (GifMakeSmallPalette
+// first with writer->adaptiveBitDepth, then GifMakePalette with the same arguments), otherwise it is built here.
+// With a global palette, pPal receives a copy of it.
+// Either way pPal is left in RGB order, ready to be written.
+// The frame is in writer->channelOrder, its rows are stride bytes apart (0 if they are packed).
+bool GifQuantizeFrame( GifWriter* writer, const uint8_t* image, uint32_t width, uint32_t height, int bitDepth, int dither, GifPalette* pPal, bool havePalette = false, uint32_t stride = 0 )
 {
     if(!writer->f) return false;
 
+    GifArena* previousArena = GifEnterArena(&writer->quantizeArena);
+
+    uint8_t* packed;
+    image = GifPackRows(image, width, height, stride, &packed);
+
     const uint8_t* oldImage = writer->firstFrame? NULL : writer->oldImage;
     writer->firstFrame = false;
 
-    GifPalette pal;
-    GifMakePalette((dither? NULL : oldImage), image, width, height, bitDepth, dither, &pal);
+    if(writer->globalPalette)
+    {
+        *pPal = writer->palette;
+        havePalette = true;
+    }
+
+    // without dithering the palette and the transparency both come from the pixels that
+    // differ from the last frame, so compare the frames once for the two of them.
+    // Ordered dithering compares the source frames instead, see GifOrderedDitherImage.
+    const uint8_t* changedMask = NULL;
+    if(oldImage && !dither)
+    {
+        GifDiffPixels(oldImage, image, (int)(width*height), writer->changedMask);
+        changedMask = writer->changedMask;
+    }
+    else if(dither == GifDitherOrdered)
+    {
+        if(oldImage && writer->haveLastSource)
+        {
+            GifDiffPixels(writer->lastSource, image, (int)(width*height), writer->changedMask);
+            changedMask = writer->changedMask;
+        }
+    }
+
+    // when few colors need a palette, a smaller one is exact (or close enough), cheaper to build and
+    // makes the table and the LZW codes shorter. Like GifMakePalette it covers the whole frame when dithering.
+    if(writer->adaptiveBitDepth && !havePalette)
+    {
+        const uint8_t* colorMask = (oldImage && !dither)? changedMask : NULL;
+        if(GifMakeSmallPalette(image, width*height, colorMask, bitDepth, writer->maxColorError, dither, pPal))
+            havePalette = true;
+    }
+
+    if(!havePalette)
+        GifMakePalette((dither? NULL : oldImage), image, width, height, bitDepth, dither, pPal, changedMask, writer->quantizer);
+
+    // the caches stay valid across frames as long as the palette does
+    GifColorCache* pCache = NULL;
+    if(writer->lookupMode != GifLookupTree)
+    {
+        const int numCaches = (dither == GifDitherOrdered)? GifIMax(1, GifIMin(writer->numThreads, kGifMaxThreads)) : 1;
+        if(numCaches > writer->numColorCaches)
+        {
+            GIF_FREE(writer->colorCache);
+            writer->colorCache = (GifColorCache*)GIF_MALLOC(sizeof(GifColorCache) * (size_t)numCaches);
+            memset(writer->colorCache, 0, sizeof(GifColorCache) * (size_t)numCaches);
+            for(int ii=0; ii<numCaches; ++ii)
+                GifResetColorCache(writer->colorCache + ii);
+            writer->numColorCaches = numCaches;
+        }
+
+        pCache = writer->colorCache;
+        if(!writer->globalPalette)
+        {
+            for(int ii=0; ii<numCaches; ++ii)
+                GifResetColorCache(pCache + ii);
+        }
+    }
+
+    typedef std::chrono::steady_clock Clock;
+    GifLookupStats& stats = writer->lookupStats;
+    memset(&stats, 0, sizeof(GifLookupStats));
 
-    if(dither)
-        GifDitherImage(oldImage, image, writer->oldImage, width, height, &pal);
+    if(writer->lookupMode == GifLookupCompare)
+    {
+        // the tree pass must not touch oldImage, the cached pass below still needs it
+        uint8_t* treeImage = (uint8_t*)GIF_TEMP_MALLOC(width*height*4);
+
+        Clock::time_point start = Clock::now();
+        GifPalettizeImage(oldImage, image, treeImage, width, height, dither, pPal, NULL, changedMask, writer->numThreads, &writer->workers);
+        stats.treeMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+        start = Clock::now();
+        GifPalettizeImage(oldImage, image, writer->oldImage, width, height, dither, pPal, pCache, changedMask, writer->numThreads, &writer->workers);
+        stats.cacheMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+        for(uint32_t ii=0; ii<width*height; ++ii)
+        {
+            if(treeImage[ii*4+3] != writer->oldImage[ii*4+3])
+                ++stats.mismatches;
+        }
+
+        GIF_TEMP_FREE(treeImage);
+    }
     else
-        GifThresholdImage(oldImage, image, writer->oldImage, width, height, &pal);
+    {
+        Clock::time_point start = Clock::now();
+        GifPalettizeImage(oldImage, image, writer->oldImage, width, height, dither, pPal, pCache, changedMask, writer->numThreads, &writer->workers);
+        double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        if(pCache) stats.cacheMs = ms;
+        else stats.treeMs = ms;
+    }
+
+    // ordered dithering and GifIsDuplicateFrame both compare against the source of the last frame
+    writer->haveLastSource = (dither == GifDitherOrdered || writer->mergeDuplicates);
+    if(writer->haveLastSource)
+    {
+        if(!writer->lastSource)
+            writer->lastSource = (uint8_t*)GIF_MALLOC(width*height*4);
+        memcpy(writer->lastSource, image, width*height*4);
+    }
+
+    if(writer->channelOrder == GifChannelsBGRA)
+        GifSwapRedBlue(pPal);
+
+    if(packed)
+        GIF_TEMP_FREE(packed);
+    GifLeaveArena(previousArena);
+
+    return true;
+}
+
+// Appends a frame quantized by GifQuantizeFrame, pPal is the palette it returned.
+// Only the area that changed since the last frame is encoded.
+bool GifWriteQuantizedFrame( GifWriter* writer, uint8_t* image, uint32_t width, uint32_t height, uint32_t delay, GifPalette* pPal )
+{
+    if(!writer->f) return false;
+
+    writer->lastFramePos = ftell(writer->f);
+    writer->lastDelay = delay;
 
-    GifWriteLzwImage(writer->f, writer->oldImage, 0, 0, width, height, delay, &pal);
+    GifArena* previousArena = GifEnterArena(&writer->writeArena);
+    GifWriteChangedImage(writer->f, image, width, height, delay, pPal, !writer->globalPalette, writer->numThreads, &writer->workers);
+    GifLeaveArena(previousArena);
 
     return true;
 }
 
+// Writes out a new frame to a GIF in progress.
+// The GIFWriter should have been created by GIFBegin.
+// AFAIK, it is legal to use different bit depths for different frames of an image -
+// this may be handy to save bits in animations that don't change much.
+// With writer->mergeDuplicates, a frame equal to the last one is not written, the last one stays up longer instead.
+// The image is in the channel order given to GifBegin, with rows stride bytes apart (0 if they are packed),
+// so a decoded QImage or bitmap can be passed without converting it first.
+bool GifWriteFrame( GifWriter* writer, const uint8_t* image, uint32_t width, uint32_t height, uint32_t delay, int bitDepth = 8, int dither = GifDitherNone, uint32_t stride = 0 )
+{
+    if(GifIsDuplicateFrame(writer, image, width, height, stride) && GifExtendDelay(writer, delay))
+        return true;
+
+    GifPalette pal;
+    if(!GifQuantizeFrame(writer, image, width, height, bitDepth, dither, &pal, false, stride))
+        return false;
+
+    return GifWriteQuantizedFrame(writer, writer->oldImage, width, height, delay, &pal);
+}
+
 // Writes the EOF code, closes the file handle, and frees temp memory used by a GIF.
 // Many if not most viewers will still display a GIF properly if the EOF code is missing,
 // but it's still a good idea to write it out.
@@ -821,9 +2440,20 @@ bool GifEnd( GifWriter* writer )
     fputc(0x3b, writer->f); // end of file
     fclose(writer->f);
     GIF_FREE(writer->oldImage);
+    GIF_FREE(writer->colorCache);
+    GIF_FREE(writer->changedMask);
+    if(writer->lastSource)
+        GIF_FREE(writer->lastSource);
+    GifArenaFree(&writer->quantizeArena);
+    GifArenaFree(&writer->writeArena);
+    GifStopWorkers(&writer->workers);
 
     writer->f = NULL;
     writer->oldImage = NULL;
+    writer->colorCache = NULL;
+    writer->numColorCaches = 0;
+    writer->changedMask = NULL;
+    writer->lastSource = NULL;
 
     return true;
 }
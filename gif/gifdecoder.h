@@ -0,0 +1,554 @@
+//
+// gifdecoder.h
+// Streaming GIF reader to go with gif.h.
+// Public domain, like gif.h.
+//
+// Frames are decoded and composited one at a time onto a single RGBA canvas, so the memory used
+// doesn't depend on the number of frames: about two canvases plus one frame's worth of color indices.
+// Nothing is cached - each call to GifReadFrame() reads just far enough into the file to produce the
+// next frame. It doesn't use Qt, so it can run on any thread.
+//
+// Handles GIF87a and GIF89a: global and local color tables, interlacing, transparency and
+// the three disposal methods. Broken or truncated data ends the animation instead of failing it:
+// whatever could be decoded is kept, like browsers do.
+//
+// USAGE:
+// Create a GifReader struct. Pass it to GifReadBegin() to open the file and read the header.
+// Call GifReadFrame() until it returns false. After each call, reader->canvas holds the composited
+// frame as RGBA8 (width*height*4, fully transparent where nothing has been drawn yet) and
+// reader->delay its delay in hundredths of a second.
+// Finally, call GifReadEnd() to close the file handle and free memory.
+// GifCountFrames() walks a file without decoding any pixels, for progress bars.
+//
+
+#ifndef __gifdecoder_h__
+#define __gifdecoder_h__
+
+#include <stdio.h>   // for FILE*
+#include <string.h>  // for memcpy and memset
+#include <stdint.h>  // for integer typedefs
+#include <stdlib.h>  // for malloc and free
+
+class GifDecoder_H
+{
+public:
+
+const static int kGifReadBufferSize = 64 * 1024;
+const static uint32_t kGifMaxCanvasPixels = 1u << 28; // refuse anything bigger than 1GB of RGBA
+
+struct GifReader
+{
+    FILE* f;
+    uint8_t* buffer;            // file data is read through this, GIF data comes in tiny blocks
+    size_t bufferPos;
+    size_t bufferEnd;
+
+    uint32_t width;
+    uint32_t height;
+    uint8_t globalPalette[256*3];
+    int globalColors;           // 0 if the file has no global color table
+    uint8_t localPalette[256*3];
+
+    uint8_t* canvas;            // composited frame, RGBA8
+    uint8_t* previous;          // canvas under the last frame, for disposal method 3. Allocated on first use
+    uint8_t* indices;           // color indices of the frame being decoded
+    size_t indicesSize;
+
+    // from the graphic control extension, for the frame that follows it
+    int nextDelay;
+    int nextTransparent;        // -1 if the frame has no transparent color
+    int nextDisposal;
+
+    // what to do with the last frame's rectangle before drawing the next one
+    int lastDisposal;
+    uint32_t lastLeft, lastTop, lastWidth, lastHeight;
+
+    int delay;                  // delay of the frame on the canvas, in hundredths of a second
+    int frameIndex;             // index of the frame on the canvas, -1 before the first
+    bool ended;
+};
+
+// Refill the read buffer. Returns false at the end of the file.
+bool GifReadFill(GifReader* reader)
+{
+    reader->bufferPos = 0;
+    reader->bufferEnd = fread(reader->buffer, 1, kGifReadBufferSize, reader->f);
+    return reader->bufferEnd > 0;
+}
+
+// Returns the next byte of the file, or -1 at the end.
+int GifReadByte(GifReader* reader)
+{
+    if(reader->bufferPos == reader->bufferEnd && !GifReadFill(reader))
+        return -1;
+    return reader->buffer[reader->bufferPos++];
+}
+
+bool GifReadBytes(GifReader* reader, uint8_t* dst, size_t count)
+{
+    while(count > 0)
+    {
+        if(reader->bufferPos == reader->bufferEnd && !GifReadFill(reader))
+            return false;
+        size_t chunk = reader->bufferEnd - reader->bufferPos;
+        if(chunk > count) chunk = count;
+        memcpy(dst, reader->buffer + reader->bufferPos, chunk);
+        reader->bufferPos += chunk;
+        dst += chunk;
+        count -= chunk;
+    }
+    return true;
+}
+
+bool GifReadSkip(GifReader* reader, size_t count)
+{
+    while(count > 0)
+    {
+        if(reader->bufferPos == reader->bufferEnd && !GifReadFill(reader))
+            return false;
+        size_t chunk = reader->bufferEnd - reader->bufferPos;
+        if(chunk > count) chunk = count;
+        reader->bufferPos += chunk;
+        count -= chunk;
+    }
+    return true;
+}
+
+// Skips a chain of data sub-blocks, up to and including the empty block that ends it.
+bool GifSkipSubBlocks(GifReader* reader)
+{
+    for(;;)
+    {
+        int size = GifReadByte(reader);
+        if(size <= 0) return size == 0;
+        if(!GifReadSkip(reader, (size_t)size)) return false;
+    }
+}
+
+// Opens the file and reads the signature, the logical screen descriptor and the global color table.
+bool GifReadHeader(GifReader* reader, const char* filename)
+{
+    memset(reader, 0, sizeof(GifReader));
+#if defined(_MSC_VER) && (_MSC_VER >= 1400)
+    fopen_s(&reader->f, filename, "rb");
+#else
+    reader->f = fopen(filename, "rb");
+#endif
+    if(!reader->f) return false;
+
+    reader->buffer = (uint8_t*)malloc(kGifReadBufferSize);
+    reader->frameIndex = -1;
+    reader->nextTransparent = -1;
+
+    uint8_t header[13];
+    if(!GifReadBytes(reader, header, 13)
+        || memcmp(header, "GIF", 3) != 0
+        || (memcmp(header+3, "87a", 3) != 0 && memcmp(header+3, "89a", 3) != 0))
+        return false;
+
+    reader->width = header[6] | (header[7] << 8);
+    reader->height = header[8] | (header[9] << 8);
+    if(header[10] & 0x80)
+    {
+        reader->globalColors = 2 << (header[10] & 7);
+        if(!GifReadBytes(reader, reader->globalPalette, (size_t)reader->globalColors * 3))
+            return false;
+    }
+    return true;
+}
+
+bool GifReadBegin( GifReader* reader, const char* filename )
+{
+    if(!GifReadHeader(reader, filename)
+        || reader->width == 0 || reader->height == 0
+        || reader->width * reader->height > kGifMaxCanvasPixels) // 16-bit sides can't overflow 32 bits
+    {
+        GifReadEnd(reader);
+        return false;
+    }
+
+    const size_t canvasBytes = (size_t)reader->width * reader->height * 4;
+    reader->canvas = (uint8_t*)malloc(canvasBytes);
+    if(!reader->canvas)
+    {
+        GifReadEnd(reader);
+        return false;
+    }
+    memset(reader->canvas, 0, canvasBytes);
+    return true;
+}
+
+void GifReadEnd( GifReader* reader )
+{
+    if(reader->f) fclose(reader->f);
+    free(reader->buffer);
+    free(reader->canvas);
+    free(reader->previous);
+    free(reader->indices);
+    reader->f = NULL;
+    reader->buffer = NULL;
+    reader->canvas = NULL;
+    reader->previous = NULL;
+    reader->indices = NULL;
+}
+
+// Reads the LZW-compressed color indices of one frame into reader->indices.
+// Returns the number of indices decoded; a short count means the data was truncated or broken.
+size_t GifReadLzw(GifReader* reader, size_t numPixels)
+{
+    int minCodeSize = GifReadByte(reader);
+    if(minCodeSize < 1 || minCodeSize > 8)
+    {
+        GifSkipSubBlocks(reader);
+        return 0;
+    }
+
+    // each code is the previous code plus one byte; strings are unwound backwards through the stack
+    uint16_t prefix[4096];
+    uint8_t suffix[4096];
+    uint8_t first[4096];
+    uint8_t stack[4096];
+
+    const int clearCode = 1 << minCodeSize;
+    const int endCode = clearCode + 1;
+    for(int ii=0; ii<clearCode; ++ii)
+    {
+        suffix[ii] = (uint8_t)ii;
+        first[ii] = (uint8_t)ii;
+    }
+
+    int codeSize = minCodeSize + 1;
+    int nextCode = clearCode + 2;
+    int prevCode = -1;
+
+    uint32_t bits = 0;
+    int numBits = 0;
+    int blockLeft = 0;
+    bool blocksEnded = false;
+
+    uint8_t* out = reader->indices;
+    size_t outPos = 0;
+
+    for(;;)
+    {
+        // get the next code, reading sub-blocks as needed
+        while(numBits < codeSize)
+        {
+            if(blockLeft == 0)
+            {
+                blockLeft = GifReadByte(reader);
+                if(blockLeft <= 0) { blocksEnded = true; break; }
+            }
+            int byte = GifReadByte(reader);
+            if(byte < 0) { blocksEnded = true; break; }
+            --blockLeft;
+            bits |= (uint32_t)byte << numBits;
+            numBits += 8;
+        }
+        if(numBits < codeSize)
+            break;
+
+        int code = (int)(bits & ((1u << codeSize) - 1));
+        bits >>= codeSize;
+        numBits -= codeSize;
+
+        if(code == clearCode)
+        {
+            codeSize = minCodeSize + 1;
+            nextCode = clearCode + 2;
+            prevCode = -1;
+            continue;
+        }
+        if(code == endCode)
+            break;
+
+        int stringCode;
+        uint8_t stringFirst;
+        if(prevCode < 0)
+        {
+            if(code >= clearCode) break;    // the first code after a clear has to be a single color
+            stringCode = code;
+            stringFirst = first[code];
+        }
+        else if(code < nextCode)
+        {
+            stringCode = code;
+            stringFirst = first[code];
+        }
+        else if(code == nextCode && nextCode < 4096)
+        {
+            // the code being defined right now: the previous string plus its own first byte
+            stringCode = code;
+            stringFirst = first[prevCode];
+        }
+        else
+        {
+            break;
+        }
+
+        if(prevCode >= 0 && nextCode < 4096)
+        {
+            prefix[nextCode] = (uint16_t)prevCode;
+            suffix[nextCode] = stringFirst;
+            first[nextCode] = first[prevCode];
+            ++nextCode;
+            if(nextCode == (1 << codeSize) && codeSize < 12)
+                ++codeSize;
+        }
+        prevCode = code;
+
+        // output the string
+        int depth = 0;
+        while(stringCode >= clearCode)
+        {
+            stack[depth++] = suffix[stringCode];
+            stringCode = prefix[stringCode];
+        }
+        stack[depth++] = suffix[stringCode];
+        while(depth > 0 && outPos < numPixels)
+            out[outPos++] = stack[--depth];
+    }
+
+    // skip the rest of the data, if we stopped early
+    if(!blocksEnded)
+    {
+        GifReadSkip(reader, (size_t)blockLeft);
+        GifSkipSubBlocks(reader);
+    }
+    return outPos;
+}
+
+// Undoes the last frame according to its disposal method.
+void GifDisposeLastFrame(GifReader* reader)
+{
+    if(reader->lastDisposal != 2 && reader->lastDisposal != 3)
+        return;
+    if(reader->lastDisposal == 3 && !reader->previous)
+        return;
+
+    const uint32_t rowBytes = reader->lastWidth * 4;
+    for(uint32_t yy=reader->lastTop; yy<reader->lastTop+reader->lastHeight; ++yy)
+    {
+        uint8_t* row = reader->canvas + ((size_t)yy * reader->width + reader->lastLeft) * 4;
+        if(reader->lastDisposal == 2)
+            memset(row, 0, rowBytes); // restore to background: like browsers, the background is transparent
+        else
+            memcpy(row, reader->previous + ((size_t)yy * reader->width + reader->lastLeft) * 4, rowBytes);
+    }
+}
+
+// Decodes an image descriptor and its data, and draws it on the canvas.
+bool GifReadImage(GifReader* reader)
+{
+    uint8_t desc[9];
+    if(!GifReadBytes(reader, desc, 9))
+        return false;
+
+    const uint32_t left = desc[0] | (desc[1] << 8);
+    const uint32_t top = desc[2] | (desc[3] << 8);
+    const uint32_t width = desc[4] | (desc[5] << 8);
+    const uint32_t height = desc[6] | (desc[7] << 8);
+    const bool interlaced = (desc[8] & 0x40) != 0;
+
+    const uint8_t* palette = reader->globalPalette;
+    int numColors = reader->globalColors;
+    if(desc[8] & 0x80)
+    {
+        numColors = 2 << (desc[8] & 7);
+        if(!GifReadBytes(reader, reader->localPalette, (size_t)numColors * 3))
+            return false;
+        palette = reader->localPalette;
+    }
+
+    const size_t numPixels = (size_t)width * height;
+    if(numPixels > reader->indicesSize)
+    {
+        free(reader->indices);
+        reader->indices = (uint8_t*)malloc(numPixels);
+        reader->indicesSize = reader->indices? numPixels : 0;
+        if(!reader->indices)
+            return false;
+    }
+    const size_t numDecoded = GifReadLzw(reader, numPixels);
+
+    // the part of the frame that is on the canvas
+    const uint32_t clipLeft = left < reader->width? left : reader->width;
+    const uint32_t clipTop = top < reader->height? top : reader->height;
+    const uint32_t clipRight = (left + width < reader->width)? left + width : reader->width;
+    const uint32_t clipBottom = (top + height < reader->height)? top + height : reader->height;
+
+    GifDisposeLastFrame(reader);
+
+    if(reader->nextDisposal == 3)
+    {
+        if(!reader->previous)
+            reader->previous = (uint8_t*)malloc((size_t)reader->width * reader->height * 4);
+        if(reader->previous)
+        {
+            for(uint32_t yy=clipTop; yy<clipBottom; ++yy)
+            {
+                const size_t offset = ((size_t)yy * reader->width + clipLeft) * 4;
+                memcpy(reader->previous + offset, reader->canvas + offset, (clipRight - clipLeft) * 4);
+            }
+        }
+    }
+
+    // draw; interlaced frames store rows 0,8,16.. then 4,12.. then 2,6.. then 1,3..
+    static const uint32_t passStart[4] = { 0, 4, 2, 1 };
+    static const uint32_t passStep[4] = { 8, 8, 4, 2 };
+    uint32_t dstRow = 0;
+    int pass = 0;
+    for(uint32_t srcRow=0; srcRow<height; ++srcRow)
+    {
+        if(interlaced)
+        {
+            if(srcRow == 0)
+                dstRow = 0;
+            else
+            {
+                dstRow += passStep[pass];
+                while(dstRow >= height && pass < 3)
+                {
+                    ++pass;
+                    dstRow = passStart[pass];
+                }
+            }
+        }
+        else
+        {
+            dstRow = srcRow;
+        }
+
+        const size_t srcStart = (size_t)srcRow * width;
+        if(srcStart >= numDecoded)
+            break;
+        const uint32_t yy = top + dstRow;
+        if(yy < clipTop || yy >= clipBottom)
+            continue;
+
+        const uint8_t* src = reader->indices + srcStart + (clipLeft - left);
+        uint8_t* dst = reader->canvas + ((size_t)yy * reader->width + clipLeft) * 4;
+        uint32_t count = clipRight - clipLeft;
+        if(srcStart + (clipLeft - left) + count > numDecoded) // the data ended in this row
+            count = (numDecoded > srcStart + (clipLeft - left))? (uint32_t)(numDecoded - srcStart - (clipLeft - left)) : 0;
+
+        for(uint32_t xx=0; xx<count; ++xx, dst += 4)
+        {
+            const int index = src[xx];
+            if(index == reader->nextTransparent)
+                continue;
+            if(index < numColors)
+            {
+                dst[0] = palette[index*3];
+                dst[1] = palette[index*3+1];
+                dst[2] = palette[index*3+2];
+            }
+            else
+            {
+                dst[0] = dst[1] = dst[2] = 0; // out of the palette: black, like most decoders
+            }
+            dst[3] = 255;
+        }
+    }
+
+    reader->lastDisposal = reader->nextDisposal;
+    reader->lastLeft = clipLeft;
+    reader->lastTop = clipTop;
+    reader->lastWidth = clipRight - clipLeft;
+    reader->lastHeight = clipBottom - clipTop;
+
+    reader->delay = reader->nextDelay;
+    reader->nextDelay = 0;
+    reader->nextTransparent = -1;
+    reader->nextDisposal = 0;
+    return true;
+}
+
+// Decodes the next frame onto reader->canvas.
+// Returns false when there are no more frames.
+bool GifReadFrame( GifReader* reader )
+{
+    if(reader->ended || !reader->canvas)
+        return false;
+
+    for(;;)
+    {
+        int block = GifReadByte(reader);
+        if(block == 0x2C) // image descriptor
+        {
+            if(!GifReadImage(reader))
+                break;
+            ++reader->frameIndex;
+            return true;
+        }
+        else if(block == 0x21) // extension
+        {
+            int label = GifReadByte(reader);
+            if(label == 0xF9) // graphic control extension
+            {
+                uint8_t gce[5];
+                if(!GifReadBytes(reader, gce, 5) || gce[0] < 4)
+                    break;
+                reader->nextDisposal = (gce[1] >> 2) & 7;
+                reader->nextDelay = gce[2] | (gce[3] << 8);
+                reader->nextTransparent = (gce[1] & 1)? gce[4] : -1;
+                if(!GifReadSkip(reader, (size_t)gce[0] - 4))
+                    break;
+            }
+            if(label < 0 || !GifSkipSubBlocks(reader))
+                break;
+        }
+        else // trailer, end of file, or garbage after the last frame
+        {
+            break;
+        }
+    }
+
+    reader->ended = true;
+    return false;
+}
+
+// Counts the frames of a file by walking its blocks, without decoding anything.
+// Returns -1 if the file can't be read as a GIF.
+int GifCountFrames( const char* filename )
+{
+    GifReader reader;
+    if(!GifReadHeader(&reader, filename))
+    {
+        GifReadEnd(&reader);
+        return -1;
+    }
+
+    int count = 0;
+    for(;;)
+    {
+        int block = GifReadByte(&reader);
+        if(block == 0x2C)
+        {
+            uint8_t desc[9];
+            if(!GifReadBytes(&reader, desc, 9))
+                break;
+            if((desc[8] & 0x80) && !GifReadSkip(&reader, (size_t)(2 << (desc[8] & 7)) * 3))
+                break;
+            if(GifReadByte(&reader) < 0 || !GifSkipSubBlocks(&reader)) // LZW minimum code size, then the data
+                break;
+            ++count;
+        }
+        else if(block == 0x21)
+        {
+            if(GifReadByte(&reader) < 0 || !GifSkipSubBlocks(&reader))
+                break;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    GifReadEnd(&reader);
+    return count;
+}
+
+};
+
+#endif
@@ -3,11 +3,33 @@
 
 #include <QPixmap>
 #include <QPainter>
+#include <QThread>
+#include <QtConcurrent/QtConcurrent>
 
 class ASCIIArt
 {
 public:
     const int limit_max_pixmap_cache = 5;
+    static const int cellSize = 7; // 每个字符对应的像素块大小，也是字体的像素大小
+
+    /**
+     * 预先画好的字符，贴到 (x, y) 时左上角在 (x + dx, y + dy)，y 是基线
+     * 颜色是预乘的 ARGB32，和 QPainter 画出来的一样
+     */
+    struct Glyph
+    {
+        QImage image;
+        int dx = 0;
+        int dy = 0;
+    };
+
+    struct GlyphAtlas
+    {
+        Glyph glyphs[128];
+        int top = 0;    // 所有字符相对基线的最高处
+        int bottom = 0; // 所有字符相对基线的最低处（不含）
+    };
+
     char toChar(int g)
     {
         if (g <= 30) {
@@ -40,35 +62,190 @@ public:
     }
 
     QPixmap setImage(const QImage &image, QColor bg = Qt::transparent)
+    {
+        return QPixmap::fromImage(renderImage(image, bg));
+    }
+
+    /**
+     * 绘制到 QImage 上，QPixmap 只能在GUI线程使用，这个可以在其他线程中调用
+     * 不再逐个 pixel() 和 drawText()：按行读取像素，字符从画好一次的字形图贴上去，大图按行分给多个线程
+     */
+    QImage renderImage(const QImage &image, QColor bg = Qt::transparent)
     {
         const int ih = image.height();
         const int iw = image.width();
 
-        QPixmap txtImage(iw, ih);
+        QImage txtImage(iw, ih, QImage::Format_ARGB32_Premultiplied);
         txtImage.fill(bg);
-        QPainter painter(&txtImage);
-        painter.setBrush(Qt::NoBrush);
-        // painter.setPen(QColor::fromHsl(rand() % 360, rand() % 256, rand() % 200));
-        painter.setPen(Qt::darkGray);
-        QFont font = painter.font();
-        font.setPixelSize(7);
+        if (iw <= 0 || ih <= 0)
+            return txtImage;
+
+        // 按行直接读取像素，不再逐个调用 pixel()
+        QImage src = image;
+        if (src.format() != QImage::Format_RGB32 && src.format() != QImage::Format_ARGB32)
+            src = src.convertToFormat(QImage::Format_ARGB32);
+
+        const int cols = (iw + cellSize - 1) / cellSize;
+        const int rows = (ih + cellSize - 1) / cellSize;
+        QVector<char> chars(cols * rows);
+        const GlyphAtlas& atlas = glyphAtlas();
+        // 线程中不能调用非 const 的 scanLine()，它会 detach
+        char* const charData = chars.data();
+        uchar* const dstBits = txtImage.bits();
+        const int dstStride = txtImage.bytesPerLine();
+
+        // 1. 每个格子取整块的平均颜色，决定用哪个字符
+        auto pickRows = [&](int rowFrom, int rowTo) {
+            QVector<int> sums(cols * 3);
+            for (int r = rowFrom; r < rowTo; r++)
+            {
+                sums.fill(0);
+                const int y0 = r * cellSize;
+                const int y1 = qMin(y0 + cellSize, ih);
+                for (int y = y0; y < y1; y++)
+                {
+                    const QRgb* line = reinterpret_cast<const QRgb*>(src.constScanLine(y));
+                    int* sum = sums.data();
+                    for (int x = 0; x < iw; x += cellSize, sum += 3)
+                    {
+                        const int x1 = qMin(x + cellSize, iw);
+                        for (int i = x; i < x1; i++)
+                        {
+                            sum[0] += qRed(line[i]);
+                            sum[1] += qGreen(line[i]);
+                            sum[2] += qBlue(line[i]);
+                        }
+                    }
+                }
+                for (int c = 0; c < cols; c++)
+                {
+                    const int count = (qMin((c + 1) * cellSize, iw) - c * cellSize) * (y1 - y0);
+                    charData[r * cols + c] = toChar(rgbtoGray(sums[c*3] / count, sums[c*3+1] / count, sums[c*3+2] / count));
+                }
+            }
+        };
+
+        // 2. 把字符贴上去。字符会超出自己的格子，所以按像素行分段：
+        //    每段只画落在自己行内的部分，跨段的字符两边各画一半，线程之间不会写同一个像素
+        auto drawRows = [&](int yFrom, int yTo) {
+            const int rowFrom = qMax(0, (yFrom - atlas.bottom) / cellSize);
+            const int rowTo = qMin(rows, (yTo - atlas.top) / cellSize + 1);
+            for (int r = rowFrom; r < rowTo; r++)
+            {
+                for (int c = 0; c < cols; c++)
+                {
+                    const Glyph& glyph = atlas.glyphs[static_cast<uchar>(charData[r * cols + c]) & 127];
+                    if (glyph.image.isNull())
+                        continue;
+                    const int gx = c * cellSize + glyph.dx;
+                    const int gy = r * cellSize + glyph.dy;
+                    const int x0 = qMax(gx, 0);
+                    const int x1 = qMin(gx + glyph.image.width(), iw);
+                    const int y0 = qMax(gy, yFrom);
+                    const int y1 = qMin(gy + glyph.image.height(), yTo);
+                    for (int y = y0; y < y1; y++)
+                    {
+                        const QRgb* from = reinterpret_cast<const QRgb*>(glyph.image.constScanLine(y - gy)) + (x0 - gx);
+                        QRgb* to = reinterpret_cast<QRgb*>(dstBits + y * dstStride) + x0;
+                        for (int x = x0; x < x1; x++, from++, to++)
+                            *to = sourceOver(*from, *to);
+                    }
+                }
+            }
+        };
+
+        // 行数少时不值得分线程
+        const int bands = qBound(1, ih / 64, QThread::idealThreadCount());
+        if (bands == 1)
+        {
+            pickRows(0, rows);
+            drawRows(0, ih);
+            return txtImage;
+        }
+        QVector<int> bandIndexes(bands);
+        for (int i = 0; i < bands; i++)
+            bandIndexes[i] = i;
+        QtConcurrent::blockingMap(bandIndexes, [&](const int& band) {
+            pickRows(rows * band / bands, rows * (band + 1) / bands);
+        });
+        QtConcurrent::blockingMap(bandIndexes, [&](const int& band) {
+            drawRows(ih * band / bands, ih * (band + 1) / bands);
+        });
+        return txtImage;
+    }
+
+private:
+    /// 预乘颜色的 source over：dst = src + dst * (1 - srcAlpha)
+    static QRgb sourceOver(QRgb src, QRgb dst)
+    {
+        const uint alpha = 255 - qAlpha(src);
+        if (alpha == 0)
+            return src;
+        uint rb = (dst & 0xff00ff) * alpha;
+        rb = ((rb + ((rb >> 8) & 0xff00ff) + 0x800080) >> 8) & 0xff00ff;
+        uint ag = ((dst >> 8) & 0xff00ff) * alpha;
+        ag = (ag + ((ag >> 8) & 0xff00ff) + 0x800080) & 0xff00ff00;
+        return src + (ag | rb);
+    }
+
+    /**
+     * 字形图只画一次：和原来逐个 drawText 一样的字体和颜色，裁掉透明的边
+     */
+    static GlyphAtlas buildGlyphAtlas(int pixelSize)
+    {
+        GlyphAtlas atlas;
+        QFont font;
+        font.setPixelSize(pixelSize);
         font.setFamily("Microsoft YaHei");
-        painter.setFont(font);
 
-        for (int i = 0; i < iw; i+= 7)
+        const int size = pixelSize * 5;
+        const QPoint origin(pixelSize * 2, pixelSize * 3); // 基线的位置，四周留足空间
+        const char levels[] = { '#', '&', '$', '*', 'o', '!' }; // 空格不用画
+        bool first = true;
+        for (char c : levels)
         {
-            for (int j = 0; j < ih; j+= 7)
+            QImage tile(size, size, QImage::Format_ARGB32_Premultiplied);
+            tile.fill(Qt::transparent);
+            QPainter painter(&tile);
+            painter.setBrush(Qt::NoBrush);
+            painter.setPen(Qt::darkGray);
+            painter.setFont(font);
+            painter.drawText(origin, QChar(c));
+            painter.end();
+
+            int left = size, right = -1, top = size, bottom = -1;
+            for (int y = 0; y < size; y++)
             {
-                const QRgb&& pixel = image.pixel(i, j);
-                int r = qRed(pixel);
-                int g = qGreen(pixel);
-                int b = qBlue(pixel);
-                int gray = rgbtoGray(r, g, b);
-                char c = toChar((int)gray);
-                painter.drawText(i, j, QChar(c));
+                const QRgb* line = reinterpret_cast<const QRgb*>(tile.constScanLine(y));
+                for (int x = 0; x < size; x++)
+                {
+                    if (qAlpha(line[x]))
+                    {
+                        left = qMin(left, x);
+                        right = qMax(right, x);
+                        top = qMin(top, y);
+                        bottom = qMax(bottom, y);
+                    }
+                }
             }
+            if (right < 0)
+                continue;
+
+            Glyph& glyph = atlas.glyphs[static_cast<uchar>(c)];
+            glyph.image = tile.copy(left, top, right - left + 1, bottom - top + 1);
+            glyph.dx = left - origin.x();
+            glyph.dy = top - origin.y();
+            atlas.top = first ? glyph.dy : qMin(atlas.top, glyph.dy);
+            atlas.bottom = first ? glyph.dy + glyph.image.height() : qMax(atlas.bottom, glyph.dy + glyph.image.height());
+            first = false;
         }
-        return txtImage;
+        return atlas;
+    }
+
+    const GlyphAtlas& glyphAtlas() const
+    {
+        static const GlyphAtlas atlas = buildGlyphAtlas(cellSize); // 多个线程同时第一次调用时也只画一次
+        return atlas;
     }
 
 };
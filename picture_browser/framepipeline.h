@@ -0,0 +1,126 @@
+#ifndef FRAMEPIPELINE_H
+#define FRAMEPIPELINE_H
+
+#include <QImage>
+#include <QList>
+#include <QFuture>
+#include <QThread>
+#include <QSettings>
+#include <QtConcurrent/QtConcurrent>
+#include <functional>
+#include "gif.h"
+
+/**
+ * 交给GIF的帧在内存中的通道顺序
+ * RGB32 和 ARGB32_Premultiplied 在小端机器上是 BGRA，GIF 直接读取，不用再转换成 RGBA8888
+ */
+inline Gif_H::GifChannelOrder gifChannelOrder()
+{
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    return Gif_H::GifChannelsBGRA;
+#else
+    return Gif_H::GifChannelsRGBA;
+#endif
+}
+
+/**
+ * 转换成 gifChannelOrder() 对应的格式，已经是这个格式时不转换
+ * 有透明通道的用 ARGB32_Premultiplied，和 QPixmap 的格式保持一致
+ */
+inline QImage toGifFrameFormat(const QImage& image, Qt::ImageConversionFlags flags = Qt::AutoColor)
+{
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    if (image.hasAlphaChannel())
+    {
+        if (image.format() != QImage::Format_ARGB32_Premultiplied)
+            return image.convertToFormat(QImage::Format_ARGB32_Premultiplied, flags);
+    }
+    else if (image.format() != QImage::Format_RGB32)
+    {
+        return image.convertToFormat(QImage::Format_RGB32, flags);
+    }
+    return image;
+#else
+    return image.convertToFormat(QImage::Format_RGBA8888, flags);
+#endif
+}
+
+/**
+ * GIF抖动方式（Gif_H::GifDitherMode），导出和录制共用一个默认值：误差扩散
+ * 旧版本只有开关，保存在 gif/dither
+ */
+inline int gifDitherSetting(const QSettings& settings)
+{
+    return settings.value("gif/ditherMode", settings.value("gif/dither", true).toBool()
+                          ? Gif_H::GifDitherFloydSteinberg : Gif_H::GifDitherNone).toInt();
+}
+
+/**
+ * 有序的帧流水线：每帧的任务在线程池中并行执行，结果按添加的顺序取出
+ * 同时在处理的帧数有上限，处理得比取出得快时等最早的一帧，内存不随帧数增长
+ */
+template <typename T>
+class FramePipeline
+{
+public:
+    explicit FramePipeline(int window = qMax(2, QThread::idealThreadCount() * 2)) : window(qMax(1, window))
+    {
+    }
+
+    /**
+     * 依次执行 produce 生成的任务，consume 按顺序处理结果，全部处理完才返回
+     * produce 设置下一帧的任务，没有更多的帧时返回 false
+     */
+    void run(std::function<bool(std::function<T()>&)> produce, std::function<void(T)> consume)
+    {
+        std::function<T()> task;
+        forever
+        {
+            if (isFull())
+                consume(takeFirst());
+            if (!produce(task))
+                break;
+            append(task);
+        }
+        while (!isEmpty())
+            consume(takeFirst());
+    }
+
+    /**
+     * 在别处排队的帧数为 pending 时，是否已经达到上限
+     * 例如取出后还要再编码、等待写入的帧，也占着内存
+     */
+    bool isFull(int pending = 0) const
+    {
+        return tasks.size() + pending >= window;
+    }
+
+    bool isEmpty() const
+    {
+        return tasks.isEmpty();
+    }
+
+    int capacity() const
+    {
+        return window;
+    }
+
+    void append(std::function<T()> task)
+    {
+        tasks.append(QtConcurrent::run(task));
+    }
+
+    /**
+     * 等待并取出最早的一帧
+     */
+    T takeFirst()
+    {
+        return tasks.takeFirst().result();
+    }
+
+private:
+    const int window;
+    QList<QFuture<T>> tasks;
+};
+
+#endif // FRAMEPIPELINE_H
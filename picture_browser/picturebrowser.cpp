@@ -137,11 +137,22 @@ PictureBrowser::PictureBrowser(QWidget *parent) :
     ui->actionGIF_Use_Display_Interval->setChecked(!gifUseRecordInterval);
     QActionGroup* gifDitherGroup = new QActionGroup(this);
     gifDitherGroup->addAction(ui->actionDither_Enabled);
+    gifDitherGroup->addAction(ui->actionDither_Ordered);
     gifDitherGroup->addAction(ui->actionDither_Disabled);
-    if (settings.value("gif/dither", true).toBool())
+    gifDither = gifDitherSetting(settings);
+    if (gifDither == Gif_H::GifDitherFloydSteinberg)
         ui->actionDither_Enabled->setChecked(true);
+    else if (gifDither == Gif_H::GifDitherOrdered)
+        ui->actionDither_Ordered->setChecked(true);
     else
         ui->actionDither_Disabled->setChecked(true);
+    QActionGroup* gifPaletteGroup = new QActionGroup(this);
+    gifPaletteGroup->addAction(ui->actionGIF_Local_Palette);
+    gifPaletteGroup->addAction(ui->actionGIF_Global_Palette);
+    if (settings.value("gif/globalPalette", false).toBool())
+        ui->actionGIF_Global_Palette->setChecked(true);
+    else
+        ui->actionGIF_Local_Palette->setChecked(true);
 
     QActionGroup* gifCompressGroup = new QActionGroup(this);
     gifCompressGroup->addAction(ui->actionGIF_Compress_None);
@@ -232,6 +243,33 @@ PictureBrowser::PictureBrowser(QWidget *parent) :
         }
     });
 
+    connect(this, &PictureBrowser::signalGeneralGIFStarted, this, [=](int frameCount){
+        progressBar->setMaximum(qMax(frameCount, 0));
+    });
+
+    connect(this, &PictureBrowser::signalUnpackGIFFinished, this, [=](QString dir, int frameCount){
+        progressBar->setMaximum(0);
+        progressBar->hide();
+        PBDEB << "分解GIF完毕，帧数：" << frameCount;
+
+        // 打开文件夹
+        auto result = QMessageBox::information(this, "分解GIF完毕", "路径：" + dir, "进入文件夹", "显示在资源管理器", "取消", 0, 2);
+        if (result == 0) // 进入文件夹
+        {
+            enterDirectory(dir);
+        }
+        else if (result == 1) // 显示在资源管理器
+        {
+            QDesktopServices::openUrl(QUrl("file:///" + dir, QUrl::TolerantMode));
+        }
+    });
+
+    connect(this, &PictureBrowser::signalGIFOpenFailed, this, [=](QString path){
+        progressBar->setMaximum(0);
+        progressBar->hide();
+        QMessageBox::warning(this, "无法打开GIF", "路径：" + path);
+    });
+
     // 预览设置
     bool resizeAutoInit = settings.value("picturebrowser/resizeAutoInit", true).toBool();
     ui->actionResize_Auto_Init->setChecked(resizeAutoInit);
@@ -1383,6 +1421,105 @@ QStringList PictureBrowser::getImageFilters()
     return QStringList{"*.jpg", "*.png", "*.jpeg", "*.gif"};
 }
 
+/**
+ * 从JPG文件头中读取图片大小，只扫描到 SOF 段，不解码
+ * 渐进式等其他编码方式返回 false，很多 MJPEG 解码器只支持基线编码
+ */
+bool PictureBrowser::getBaselineJpegSize(const QByteArray &data, QSize &size)
+{
+    const uchar* bytes = reinterpret_cast<const uchar*>(data.constData());
+    const int length = data.size();
+    if (length < 4 || bytes[0] != 0xFF || bytes[1] != 0xD8)
+        return false;
+
+    int pos = 2;
+    while (pos + 4 <= length)
+    {
+        if (bytes[pos] != 0xFF)
+            return false;
+        const uchar marker = bytes[pos+1];
+        if (marker == 0xFF) // 填充
+        {
+            pos++;
+            continue;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) // 没有长度的标记
+        {
+            pos += 2;
+            continue;
+        }
+        if (marker == 0xC0 || marker == 0xC1) // 基线 / 扩展顺序编码
+        {
+            if (pos + 9 > length)
+                return false;
+            size = QSize((bytes[pos+7] << 8) | bytes[pos+8], (bytes[pos+5] << 8) | bytes[pos+6]);
+            return true;
+        }
+        if ((marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+                || marker == 0xDA || marker == 0xD9) // 其他编码方式，或者还没有 SOF 就开始了数据
+            return false;
+        pos += 2 + ((bytes[pos+2] << 8) | bytes[pos+3]);
+    }
+    return false;
+}
+
+/**
+ * 解码出来的一帧画布
+ * 画布在解码下一帧时会被修改，复制一份交给线程池
+ */
+QImage PictureBrowser::decodedCanvas(const GifDecoder_H::GifReader &reader)
+{
+    return QImage(reader.canvas, static_cast<int>(reader.width), static_cast<int>(reader.height),
+                  QImage::Format_RGBA8888).copy();
+}
+
+/**
+ * 读取WAV文件头，找到 PCM 数据的位置，不读取音频数据
+ * 只支持未压缩的 PCM；没有正常结束的录音，data 块的长度不对，就到文件末尾为止
+ */
+bool PictureBrowser::readWavInfo(QFile &file, WavInfo &info)
+{
+    auto u16 = [](const uchar* p) { return static_cast<int>(p[0] | (p[1] << 8)); };
+    auto u32 = [](const uchar* p) { return static_cast<qint64>(p[0] | (p[1] << 8) | (p[2] << 16)) | (static_cast<qint64>(p[3]) << 24); };
+
+    uchar head[40];
+    if (!file.seek(0) || file.read(reinterpret_cast<char*>(head), 12) != 12
+            || memcmp(head, "RIFF", 4) != 0 || memcmp(head + 8, "WAVE", 4) != 0)
+        return false;
+
+    bool hasFormat = false;
+    qint64 pos = 12;
+    while (file.seek(pos) && file.read(reinterpret_cast<char*>(head), 8) == 8)
+    {
+        const qint64 chunkSize = u32(head + 4);
+        if (memcmp(head, "fmt ", 4) == 0)
+        {
+            if (chunkSize < 16 || file.read(reinterpret_cast<char*>(head), 16) != 16)
+                return false;
+            int format = u16(head);
+            if (format == 0xFFFE && chunkSize >= 40 && file.read(reinterpret_cast<char*>(head + 16), 24) == 24)
+                format = u16(head + 24); // WAVE_FORMAT_EXTENSIBLE，子格式GUID的开头
+            info.channels = u16(head + 2);
+            info.sampleRate = static_cast<int>(u32(head + 4));
+            info.bits = u16(head + 14);
+            if (format != WAVE_FORMAT_PCM || info.channels < 1 || info.sampleRate < 1
+                    || info.bits < 8 || info.bits > 32 || info.bits % 8)
+                return false;
+            hasFormat = true;
+        }
+        else if (memcmp(head, "data", 4) == 0)
+        {
+            info.dataOffset = pos + 8;
+            info.dataSize = file.size() - info.dataOffset;
+            if (chunkSize > 0 && chunkSize < info.dataSize)
+                info.dataSize = chunkSize;
+            return hasFormat;
+        }
+        pos += 8 + chunkSize + (chunkSize & 1);
+    }
+    return false;
+}
+
 bool PictureBrowser::copyDirectoryFiles(const QString &fromDir, const QString &toDir, bool coverFileIfExist)
 {
     QDir sourceDir(fromDir);
@@ -1645,37 +1782,155 @@ void PictureBrowser::on_actionGeneral_GIF_triggered()
     size_t ht = static_cast<uint32_t>(size.height() / prop);
     size_t iv = static_cast<uint32_t>(interval / 8); // GIF合成的工具有问题，只能自己微调时间了
 
+    // 调色板查找方式：0 k-d树，1 缓存，2 两者对比（输出每帧耗时）
+    auto lookupMode = static_cast<Gif_H::GifLookupMode>(settings.value("gif/paletteLookup", Gif_H::GifLookupCache).toInt());
+    // 全局调色板：所有帧共用一个调色板，文件更小、颜色不闪烁；否则每帧单独生成调色板，画质更好
+    bool globalPalette = settings.value("gif/globalPalette", false).toBool();
+    // 调色板生成方式：0 中位切分（逐像素），1 颜色直方图，2 颜色直方图（每4个像素取样）
+    auto quantizer = static_cast<Gif_H::GifQuantizer>(settings.value("gif/quantizer", Gif_H::GifQuantizeMedianSplit).toInt());
+    // 合并重复帧：和上一帧相同（最多 duplicateThreshold 个像素不同）的帧不再写入，只延长上一帧的时间
+    bool mergeDuplicates = settings.value("gif/mergeDuplicates", true).toBool();
+    uint32_t duplicateThreshold = settings.value("gif/duplicateThreshold", 0).toUInt();
+    // 自适应位深：变化部分颜色少的帧用更小的调色板（每个通道误差不超过 maxColorError 时合并颜色）
+    bool adaptiveBitDepth = settings.value("gif/adaptiveBitDepth", true).toBool();
+    int maxColorError = settings.value("gif/maxColorError", 0).toInt();
+
     // 创建GIF
     progressBar->setMaximum(pixmapPaths.size());
     progressBar->show();
     QtConcurrent::run([=]{
+        QDir(dirPath).mkpath(dirPath);
         Gif_H m_Gif;
+
+        // 流水线：读取、缩放、转换格式（抖动时还有生成调色板）在线程池中并行，
+        // 量化要对比上一帧的结果、LZW要按顺序写入文件，这两步串行，但写入和下一帧的量化同时进行
+        // 生成的文件和逐帧调用 GifWriteFrame 完全一样
+        struct GifFrame
+        {
+            QImage image;
+            Gif_H::GifPalette pal;
+        };
+        // 帧直接以解码出来的格式交给GIF：JPG 解码为 RGB32，内存中是 BGRA，由 GifBegin 的 channelOrder 说明，
+        // 不再转换成 RGBA8888；缩小在解码时完成（JPG 直接按比例解码），不再另外缩放一次
+        auto loadFrame = [=](QString path, bool makePalette) -> GifFrame {
+            GifFrame frame;
+            QImageReader reader(path); // QPixmap 只能在GUI线程使用
+            if (prop > 1)
+                reader.setScaledSize(QSize(static_cast<int>(wt), static_cast<int>(ht)));
+            QImage image = reader.read();
+            if (image.isNull())
+                return frame;
+            frame.image = toGifFrameFormat(image, imageConversion);
+            if (makePalette) // 抖动时调色板只和当前帧有关（两种抖动都是），和 GifQuantizeFrame 一样先试更小的调色板
+            {
+                Gif_H gif;
+                if (!adaptiveBitDepth || !gif.GifMakeSmallPalette(frame.image.constBits(), wt * ht, nullptr, 8, maxColorError, true, &frame.pal))
+                    gif.GifMakePalette(nullptr, frame.image.constBits(), wt, ht, 8, true, &frame.pal, nullptr, quantizer);
+            }
+            return frame;
+        };
+
+        // 全局调色板从均匀分布的几帧中取样生成
+        Gif_H::GifPalette globalPal;
+        if (globalPalette)
+        {
+            const int sampleCount = qMin(8, pixmapPaths.size());
+            QList<QFuture<GifFrame>> samplings;
+            for (int i = 0; i < sampleCount; i++)
+            {
+                QString path = pixmapPaths.at(i * pixmapPaths.size() / sampleCount);
+                samplings.append(QtConcurrent::run([=]{ return loadFrame(path, false); }));
+            }
+            QList<QImage> samples;
+            QVector<const uint8_t*> sampleBits;
+            for (int i = 0; i < samplings.size(); i++)
+            {
+                QImage image = samplings[i].result().image;
+                if (image.isNull())
+                    continue;
+                samples.append(image);
+                sampleBits.append(samples.last().constBits());
+            }
+            if (sampleBits.isEmpty())
+            {
+                PBDEB << "读取图片失败，无法生成全局调色板";
+                return;
+            }
+            m_Gif.GifMakeGlobalPalette(sampleBits.constData(), static_cast<uint32_t>(sampleBits.size()), wt, ht, 8, gifDither, &globalPal, quantizer);
+        }
+
         Gif_H::GifWriter* m_GifWriter = new Gif_H::GifWriter;
-        if (!m_Gif.GifBegin(m_GifWriter, gifPath.toLocal8Bit().data(), wt, ht, iv))
+        if (!m_Gif.GifBegin(m_GifWriter, gifPath.toLocal8Bit().data(), wt, ht, iv, 8, gifDither, globalPalette ? &globalPal : nullptr, gifChannelOrder()))
         {
             PBDEB << "开启gif失败";
             delete m_GifWriter;
             return;
         }
-
-        QDir(dirPath).mkpath(dirPath);
-        for (int i = 0; i < pixmapPaths.size(); i++)
-        {
-            QPixmap pixmap(pixmapPaths.at(i));
-            if (!pixmap.isNull())
+        m_GifWriter->lookupMode = lookupMode;
+        m_GifWriter->quantizer = quantizer;
+        // 有序抖动和LZW压缩时，大图分成几条分给多个线程；量化和写入共用这个 writer 的一组线程，
+        // 用到时才启动、每帧复用，GifEnd 时结束，调用的线程也分担一部分
+        m_GifWriter->numThreads = QThread::idealThreadCount();
+        m_GifWriter->mergeDuplicates = mergeDuplicates;
+        m_GifWriter->duplicateThreshold = duplicateThreshold;
+        m_GifWriter->adaptiveBitDepth = adaptiveBitDepth;
+        m_GifWriter->maxColorError = maxColorError;
+        const bool framePalette = gifDither && !globalPalette; // 每帧的调色板在线程池中生成
+
+        Gif_H* gif = &m_Gif;
+        QByteArray indexed(static_cast<int>(wt * ht * 4), 0); // 正在写入的帧
+        uint8_t* indexedBits = reinterpret_cast<uint8_t*>(indexed.data());
+        Gif_H::GifPalette writingPal;
+        Gif_H::GifPalette* pWritingPal = &writingPal;
+        QFuture<void> writing;
+        int mergedCount = 0;
+        int loadIndex = 0;
+        int i = 0; // 正在量化的帧
+        FramePipeline<GifFrame> loadings;
+        loadings.run([&](std::function<GifFrame()>& task) {
+            if (loadIndex >= pixmapPaths.size())
+                return false;
+            QString path = pixmapPaths.at(loadIndex++);
+            task = [=]{ return loadFrame(path, framePalette); };
+            return true;
+        }, [&](GifFrame frame) {
+            bool merged = false;
+            const uint32_t stride = static_cast<uint32_t>(frame.image.bytesPerLine());
+            if (!frame.image.isNull() && m_Gif.GifIsDuplicateFrame(m_GifWriter, frame.image.constBits(), wt, ht, stride))
             {
-                if (prop > 1)
-                    pixmap = pixmap.scaled(static_cast<int>(wt), static_cast<int>(ht));
-                m_Gif.GifWriteFrame(m_GifWriter, pixmap.toImage().convertToFormat(QImage::Format_RGBA8888, imageConversion).bits(), wt, ht, iv, 8, gifDither);
+                writing.waitForFinished(); // 要改写上一帧的延时，必须等它写完
+                merged = m_Gif.GifExtendDelay(m_GifWriter, iv); // 延时超出上限时仍然写入这一帧
+                if (merged)
+                    mergedCount++;
             }
-            emit signalGeneralGIFProgress(i+1);
-        }
+            if (!frame.image.isNull() && !merged)
+            {
+                m_Gif.GifQuantizeFrame(m_GifWriter, frame.image.constBits(), wt, ht, 8, gifDither, &frame.pal, framePalette, stride);
+                if (lookupMode == Gif_H::GifLookupCompare)
+                {
+                    const Gif_H::GifLookupStats& stats = m_GifWriter->lookupStats;
+                    PBDEB << "调色板查找" << i << "k-d树:" << stats.treeMs << "ms  缓存:" << stats.cacheMs
+                          << "ms  不一致:" << stats.mismatches;
+                }
+
+                writing.waitForFinished();
+                memcpy(indexedBits, m_GifWriter->oldImage, static_cast<size_t>(indexed.size()));
+                writingPal = frame.pal;
+                writing = QtConcurrent::run([=]{
+                    gif->GifWriteQuantizedFrame(m_GifWriter, indexedBits, wt, ht, iv, pWritingPal);
+                });
+            }
+            emit signalGeneralGIFProgress(++i);
+        });
+        writing.waitForFinished();
+        // 量化和写入各有一块复用的临时内存，前一两帧之后不应再从堆上分配（仅调试版统计）
+        PBDEB << "GIF临时内存堆分配次数:" << m_Gif.GifHeapAllocs(m_GifWriter);
 
         m_Gif.GifEnd(m_GifWriter);
         delete m_GifWriter;
 
         emit signalGeneralGIFFinished(gifPath);
-        PBDEB << "GIF生成完毕：" << size << pixmapPaths.size() << interval << compress;
+        PBDEB << "GIF生成完毕：" << size << pixmapPaths.size() << interval << compress << "合并重复帧:" << mergedCount;
     });
 }
 
@@ -1734,30 +1989,41 @@ void PictureBrowser::on_actionUnpack_GIF_File_triggered()
     }
 
     // 开始提取
+    // 逐帧解码（内存中只有当前一帧），保存图片交给线程池并行编码，不阻塞界面
     QDir saveDir(dir);
     saveDir.mkpath(saveDir.absolutePath());
-    QMovie movie(path);
-    movie.setCacheMode(QMovie::CacheAll);
-    for (int i = 0; i < movie.frameCount(); ++i)
-    {
-        movie.jumpToFrame(i);
-        QImage image = movie.currentImage();
-        QFile file(saveDir.absoluteFilePath(QString("%1.jpg").arg(i)));
-        file.open(QFile::WriteOnly);
-        image.save(&file, "JPG");
-        file.close();
-    }
+    progressBar->setMaximum(0); // 数完帧数之前显示为忙碌
+    progressBar->show();
+    QtConcurrent::run([=]{
+        QByteArray localPath = path.toLocal8Bit();
+        GifDecoder_H decoder;
+        emit signalGeneralGIFStarted(decoder.GifCountFrames(localPath.data()));
 
-    // 打开文件夹
-    auto result = QMessageBox::information(this, "分解GIF完毕", "路径：" + saveDir.absolutePath(), "进入文件夹", "显示在资源管理器", "取消", 0, 2);
-    if (result == 0) // 进入文件夹
-    {
-        enterDirectory(saveDir.absolutePath());
-    }
-    else if (result == 1) // 显示在资源管理器
-    {
-        QDesktopServices::openUrl(QUrl("file:///" + saveDir.absolutePath(), QUrl::TolerantMode));
-    }
+        GifDecoder_H::GifReader reader;
+        if (!decoder.GifReadBegin(&reader, localPath.data()))
+        {
+            PBDEB << "打开GIF失败：" << path;
+            saveDir.rmdir(saveDir.absolutePath()); // 还是空的，不留下
+            emit signalGIFOpenFailed(path);
+            return;
+        }
+
+        int index = 0;
+        int saved = 0;
+        FramePipeline<bool> savings;
+        savings.run([&](std::function<bool()>& task) {
+            if (!decoder.GifReadFrame(&reader))
+                return false;
+            QImage image = decodedCanvas(reader);
+            QString filePath = saveDir.absoluteFilePath(QString("%1.jpg").arg(index++));
+            task = [=]{ return image.save(filePath, "JPG"); };
+            return true;
+        }, [&](bool) {
+            emit signalGeneralGIFProgress(++saved);
+        });
+        decoder.GifReadEnd(&reader);
+        emit signalUnpackGIFFinished(saveDir.absolutePath(), index);
+    });
 }
 
 /**
@@ -1794,61 +2060,95 @@ void PictureBrowser::on_actionGIF_ASCII_Art_triggered()
         return ;
     }
 
+    // 流水线：逐帧解码，字符画在线程池中并行绘制，按顺序写入GIF
+    bool mergeDuplicates = settings.value("gif/mergeDuplicates", true).toBool();
+    bool adaptiveBitDepth = settings.value("gif/adaptiveBitDepth", true).toBool();
+    progressBar->setMaximum(0);
+    progressBar->show();
     QtConcurrent::run([=]{
-        // 初始化
-        QMovie movie(path);
-        ASCIIArt art;
-        movie.jumpToFrame(0);
+        QByteArray localPath = path.toLocal8Bit();
+        GifDecoder_H decoder;
+        emit signalGeneralGIFStarted(decoder.GifCountFrames(localPath.data()));
 
-        // 生成cache
-        QList<QPixmap> cachePixmaps;
-        QList<QPixmap> srcPixmaps;
-        int count = movie.frameCount();
-        for (int i = 0; i < count; i++)
+        GifDecoder_H::GifReader reader;
+        if (!decoder.GifReadBegin(&reader, localPath.data()))
         {
-            srcPixmaps.insert(i, movie.currentPixmap());
-            cachePixmaps.insert(i, art.setImage(movie.currentImage(), Qt::white));
-            movie.jumpToNextFrame();
+            PBDEB << "打开GIF失败：" << path;
+            emit signalGIFOpenFailed(path);
+            return;
         }
 
-        QSize size = cachePixmaps.first().size();
-        size_t wt = static_cast<uint32_t>(size.width());
-        size_t ht = static_cast<uint32_t>(size.height());
-        size_t iv = static_cast<uint32_t>(movie.speed()) / 8;
-
+        uint32_t wt = reader.width;
+        uint32_t ht = reader.height;
         Gif_H m_Gif;
         Gif_H::GifWriter* m_GifWriter = new Gif_H::GifWriter;
-        if (!m_Gif.GifBegin(m_GifWriter, savePath.toLocal8Bit().data(), wt, ht, iv))
+        // delay 只决定是否写入循环播放的扩展块，不能为0；每帧的延时在写入时按原GIF设置
+        // 字符画在 ARGB32_Premultiplied 上绘制，正是 gifChannelOrder() 的格式
+        if (!m_Gif.GifBegin(m_GifWriter, savePath.toLocal8Bit().data(), wt, ht, 1, 8, Gif_H::GifDitherNone, nullptr, gifChannelOrder()))
         {
             PBDEB << "开启gif失败";
             delete m_GifWriter;
+            decoder.GifReadEnd(&reader);
+            QMetaObject::invokeMethod(progressBar, "hide");
             return;
         }
+        m_GifWriter->mergeDuplicates = mergeDuplicates; // 字符画中不动的部分很多，相同的帧只延长上一帧
+        m_GifWriter->adaptiveBitDepth = adaptiveBitDepth;
 
-        for (int i = 0; i < cachePixmaps.size(); i++)
-        {
-            m_Gif.GifWriteFrame(m_GifWriter,
-                                cachePixmaps.at(i).toImage()
-                                    .convertToFormat(QImage::Format_RGBA8888).bits(),
-                                wt, ht, iv);
-        }
+        QList<int> delays;
+        int index = 0;
+        FramePipeline<QImage> renderings;
+        renderings.run([&](std::function<QImage()>& task) {
+            if (!decoder.GifReadFrame(&reader))
+                return false;
+            QImage frame = decodedCanvas(reader);
+            task = [=]{
+                ASCIIArt art;
+                return art.renderImage(frame, Qt::white);
+            };
+            delays.append(reader.delay); // 保留原GIF每帧的延时
+            return true;
+        }, [&](QImage art) {
+            m_Gif.GifWriteFrame(m_GifWriter, art.constBits(), wt, ht, static_cast<uint32_t>(delays.takeFirst()),
+                                8, Gif_H::GifDitherNone, static_cast<uint32_t>(art.bytesPerLine()));
+            emit signalGeneralGIFProgress(++index);
+        });
+        decoder.GifReadEnd(&reader);
 
         m_Gif.GifEnd(m_GifWriter);
         delete m_GifWriter;
 
         emit signalGeneralGIFFinished(savePath);
-        PBDEB << "GIF生成完毕：" << size << cachePixmaps.first().size() << iv;
+        PBDEB << "GIF生成完毕：" << QSize(static_cast<int>(wt), static_cast<int>(ht)) << index;
     });
 }
 
 void PictureBrowser::on_actionDither_Enabled_triggered()
 {
-    settings.setValue("gif/dither", true);
+    gifDither = Gif_H::GifDitherFloydSteinberg;
+    settings.setValue("gif/ditherMode", gifDither);
+}
+
+void PictureBrowser::on_actionDither_Ordered_triggered()
+{
+    gifDither = Gif_H::GifDitherOrdered;
+    settings.setValue("gif/ditherMode", gifDither);
 }
 
 void PictureBrowser::on_actionDither_Disabled_triggered()
 {
-    settings.setValue("gif/dither", false);
+    gifDither = Gif_H::GifDitherNone;
+    settings.setValue("gif/ditherMode", gifDither);
+}
+
+void PictureBrowser::on_actionGIF_Local_Palette_triggered()
+{
+    settings.setValue("gif/globalPalette", false);
+}
+
+void PictureBrowser::on_actionGIF_Global_Palette_triggered()
+{
+    settings.setValue("gif/globalPalette", true);
 }
 
 void PictureBrowser::on_actionGeneral_AVI_triggered()
@@ -1894,37 +2194,236 @@ void PictureBrowser::on_actionGeneral_AVI_triggered()
     size_t ht = static_cast<uint32_t>(size.height() / prop);
     size_t iv = static_cast<uint32_t>(interval);
 
+    // 连续截图时一起录制的音频：参数文件中的 audio/file 和开始录制的时间 audio/start
+    // 没有记录时，使用同一目录下的 audio.wav，认为和第一帧同时开始
+    QString audioPath;
+    qint64 audioStart = 0;
+    {
+        QSettings params(QDir(currentDirPath).absoluteFilePath(SEQUENCE_PARAM_FILE), QSettings::IniFormat);
+        QString audioFile = params.value("audio/file", "audio.wav").toString();
+        if (QFileInfo(QDir(currentDirPath).absoluteFilePath(audioFile)).isFile())
+        {
+            audioPath = QDir(currentDirPath).absoluteFilePath(audioFile);
+            audioStart = params.value("audio/start", 0).toLongLong();
+        }
+    }
+
+    // 每帧的截图时间，从文件名中读取，读不到的按间隔推算
+    QList<qint64> frameTimes;
+    bool allTimesParsed = true;
+    for (int i = 0; i < pixmapPaths.size(); i++)
+    {
+        QDateTime time = QDateTime::fromString(QFileInfo(pixmapPaths.at(i)).completeBaseName(), "yyyy-MM-dd hh-mm-ss.zzz");
+        if (!time.isValid())
+            allTimesParsed = false;
+        frameTimes.append(time.isValid() ? time.toMSecsSinceEpoch() : (i ? frameTimes.last() + interval : 0));
+    }
+    // 推算出来的时间和 audio/start 不在同一个时间轴上，这时音频从第一帧开始
+    if (audioStart <= 0 || !allTimesParsed)
+        audioStart = frameTimes.first();
+
     // 创建GIF
     progressBar->setMaximum(pixmapPaths.size());
     progressBar->show();
     QtConcurrent::run([=]{
         QDir(dirPath).mkpath(dirPath);
         avi_t* avi = AVI_open_output_file(gifPath.toLocal8Bit().data());
-        AVI_set_video(avi, wt, ht, 1000/interval, "mjpg");
-
-        for (int i = 0; i < pixmapPaths.size(); i++)
+        AVI_set_video(avi, wt, ht, 1000.0/interval, "mjpg");
+
+        // 音频和帧交错写入，要在写入数据之前设置
+        QFile audioFile(audioPath);
+        WavInfo wav{};
+        bool hasAudio = !audioPath.isEmpty() && audioFile.open(QIODevice::ReadOnly) && readWavInfo(audioFile, wav);
+        if (hasAudio)
+            AVI_set_audio(avi, wav.channels, wav.sampleRate, wav.bits, WAVE_FORMAT_PCM, wav.sampleRate * wav.channels * wav.bits / 1000);
+        else if (!audioPath.isEmpty())
+            qDebug() << "无法读取音频，只生成视频：" << audioPath;
+        // 帧先攒在内存中，满了才写一次文件；索引按帧数预先分配
+        // 只有JPG直接写入时才能从第一张图估计每帧的大小，这时再按视频和音频的平均大小预留磁盘空间（avilib 中有上限）
+        AVI_set_output_buffer(avi, 4 << 20);
+        long frameBytes = 0;
+        const QString firstPath = pixmapPaths.first();
+        if (prop == 1 && (firstPath.endsWith(".jpg", Qt::CaseInsensitive) || firstPath.endsWith(".jpeg", Qt::CaseInsensitive)))
+        {
+            QFile file(firstPath);
+            QSize jpegSize;
+            if (file.open(QIODevice::ReadOnly) && getBaselineJpegSize(file.readAll(), jpegSize)
+                    && jpegSize == QSize(static_cast<int>(wt), static_cast<int>(ht)))
+                frameBytes = static_cast<long>(file.size());
+        }
+        const long audioBytes = hasAudio ? static_cast<long>(static_cast<qint64>(interval) * wav.sampleRate * wav.channels * (wav.bits / 8) / 1000) : 0;
+        const int chunksPerFrame = hasAudio ? 2 : 1;
+        AVI_set_output_hint(avi, pixmapPaths.size() * chunksPerFrame, frameBytes ? (frameBytes + audioBytes) / chunksPerFrame : 0);
+
+        // 读取、缩放、JPG编码在线程池中并行，写入AVI按原来的顺序
+        // 编码好还没轮到写入的帧也算在同时处理的帧数内
+        // 先读取并计算哈希，和上一帧相同的不再编码，只写一条指向上一帧的索引
+        struct LoadedFrame
         {
-            QPixmap pixmap(pixmapPaths.at(i));
-            if (!pixmap.isNull())
+            QByteArray hash;
+            QByteArray jpeg; // 可以直接写入的JPG
+            QImage image;    // 需要重新编码的图片
+        };
+        auto loadFrame = [=](QString path) -> LoadedFrame {
+            LoadedFrame frame;
+            // 不压缩时，大小相同的JPG直接作为 MJPEG 的一帧写入，不解码也不重新编码，没有损失
+            if (prop == 1 && (path.endsWith(".jpg", Qt::CaseInsensitive) || path.endsWith(".jpeg", Qt::CaseInsensitive)))
             {
-                if (prop > 1)
-                    pixmap = pixmap.scaled(static_cast<int>(wt), static_cast<int>(ht));
-                QByteArray ba;
-                QBuffer    bf(&ba);
-                if (!pixmap.save(&bf, "jpg", -1))
+                QFile file(path);
+                if (file.open(QIODevice::ReadOnly))
                 {
-                    qDebug() << "保存图片Buffer失败" << pixmapPaths.at(i);
-                    continue;
+                    QByteArray ba = file.readAll();
+                    QSize jpegSize;
+                    if (getBaselineJpegSize(ba, jpegSize) && jpegSize == QSize(static_cast<int>(wt), static_cast<int>(ht)))
+                    {
+                        frame.hash = QCryptographicHash::hash(ba, QCryptographicHash::Md5);
+                        frame.jpeg = ba;
+                        return frame;
+                    }
                 }
-                AVI_write_frame(avi, ba.data(), ba.size(), 1);
             }
-            emit signalGeneralGIFProgress(i+1);
+
+            QImageReader reader(path); // QPixmap 只能在GUI线程使用
+            if (prop > 1)
+                reader.setScaledSize(QSize(static_cast<int>(wt), static_cast<int>(ht)));
+            frame.image = reader.read();
+            if (frame.image.isNull())
+                return frame;
+            // 按行计算，不包括行尾对齐的字节
+            QCryptographicHash hash(QCryptographicHash::Md5);
+            const int lineBytes = (frame.image.width() * frame.image.depth() + 7) / 8;
+            hash.addData(reinterpret_cast<const char*>(&lineBytes), sizeof(lineBytes));
+            for (int y = 0; y < frame.image.height(); y++)
+                hash.addData(reinterpret_cast<const char*>(frame.image.constScanLine(y)), lineBytes);
+            frame.hash = hash.result();
+            return frame;
+        };
+        auto encodeFrame = [=](QImage image) -> QByteArray {
+            QByteArray ba;
+            QBuffer bf(&ba);
+            if (!image.save(&bf, "jpg", -1))
+            {
+                qDebug() << "保存图片Buffer失败";
+                ba.clear();
+            }
+            return ba;
+        };
+
+        // 每帧之后写入这一帧时长的PCM，从音频文件中按块读取，不整个载入
+        // 每段从这帧的截图时间开始；和上一段的结尾相差不到半帧时接着上一段，声音保持连续
+        const int blockAlign = hasAudio ? wav.channels * wav.bits / 8 : 1;
+        const qint64 audioSamples = hasAudio ? wav.dataSize / blockAlign : 0;
+        qint64 samplesWritten = 0; // AVI中已写入的采样数
+        qint64 audioPos = 0;       // 下一段在音频文件中的起始采样
+        QByteArray pcm;
+        auto writeAudio = [&](int aviFrames, qint64 frameTime) {
+            // 累计计算每段的采样数，不会因为取整越差越多
+            const qint64 end = static_cast<qint64>(aviFrames) * interval * wav.sampleRate / 1000;
+            const qint64 count = end - samplesWritten;
+            if (count <= 0)
+                return;
+            const qint64 expected = (frameTime - audioStart) * wav.sampleRate / 1000;
+            if (qAbs(expected - audioPos) > count / 2)
+                audioPos = expected;
+
+            // 在音频之外的部分为静音，8位的PCM是无符号数
+            pcm.fill(wav.bits == 8 ? '\x80' : '\0', static_cast<int>(count * blockAlign));
+            const qint64 from = qMax(audioPos, qint64(0));
+            const qint64 to = qMin(audioPos + count, audioSamples);
+            if (from < to && audioFile.seek(wav.dataOffset + from * blockAlign))
+                audioFile.read(pcm.data() + (from - audioPos) * blockAlign, (to - from) * blockAlign);
+
+            if (AVI_write_audio(avi, pcm.data(), pcm.size()) != 0)
+            {
+                qDebug() << "写入音频失败，之后只写入视频：" << AVI_strerror();
+                hasAudio = false;
+                return;
+            }
+            audioPos += count;
+            samplesWritten = end;
+        };
+
+        // 等待写入的帧：重复帧、直接写入的JPG、正在编码的图片
+        struct PendingFrame
+        {
+            int index;
+            bool dup;
+            bool encode;
+            QByteArray jpeg;
+            QImage image; // 重复帧也保留自己的数据，上一帧没写入时用
+            QFuture<QByteArray> encoding;
+            bool isReady() const { return !encode || encoding.isFinished(); }
+        };
+        int aviFrames = 0;
+        int dupFrames = 0;
+        bool lastWritten = false; // 上一帧是否写入成功，重复帧指向的就是它
+        auto writeFrame = [&](PendingFrame frame) {
+            if (frame.dup && lastWritten)
+            {
+                lastWritten = AVI_dup_frame(avi) == 0;
+                dupFrames++;
+            }
+            else
+            {
+                // 上一帧编码或写入失败时，重复帧不能指向更早的另一张图，要写入自己
+                QByteArray ba = frame.encode ? frame.encoding.result()
+                                             : (frame.jpeg.isEmpty() && !frame.image.isNull() ? encodeFrame(frame.image) : frame.jpeg);
+                lastWritten = !ba.isEmpty() && AVI_write_frame(avi, ba.data(), ba.size(), 1) == 0;
+            }
+            if (AVI_video_frames(avi) > aviFrames) // 写入失败的帧不算，音频不往后推
+            {
+                aviFrames = static_cast<int>(AVI_video_frames(avi));
+                if (hasAudio)
+                    writeAudio(aviFrames, frameTimes.at(frame.index));
+            }
+            emit signalGeneralGIFProgress(frame.index+1);
+        };
+
+        FramePipeline<LoadedFrame> loadings;
+        QList<PendingFrame> pendings;
+        QByteArray lastHash;
+        int loadIndex = 0;
+        for (int i = 0; i < pixmapPaths.size(); i++)
+        {
+            while (loadIndex < pixmapPaths.size() && !loadings.isFull(pendings.size()))
+            {
+                QString path = pixmapPaths.at(loadIndex++);
+                loadings.append([=]{ return loadFrame(path); });
+            }
+
+            LoadedFrame loaded = loadings.takeFirst();
+            PendingFrame pending{i, false, false, QByteArray(), QImage(), QFuture<QByteArray>()};
+            if (!loaded.hash.isEmpty() && loaded.hash == lastHash)
+            {
+                pending.dup = true;
+                pending.jpeg = loaded.jpeg;
+                pending.image = loaded.image;
+            }
+            else if (!loaded.image.isNull())
+            {
+                QImage image = loaded.image;
+                pending.encode = true;
+                pending.encoding = QtConcurrent::run([=]{ return encodeFrame(image); });
+            }
+            else
+            {
+                pending.jpeg = loaded.jpeg;
+            }
+            lastHash = loaded.hash;
+            pendings.append(pending);
+
+            // 按顺序写入已经完成的帧，排队太多时等待最前面的
+            while (!pendings.isEmpty() && (pendings.size() >= loadings.capacity() || pendings.first().isReady()))
+                writeFrame(pendings.takeFirst());
         }
+        while (!pendings.isEmpty())
+            writeFrame(pendings.takeFirst());
 
-        AVI_close(avi);
+        if (AVI_close(avi) != 0) // 写入失败后索引和文件不一致，不会写入文件头
+            qDebug() << "生成AVI失败：" << AVI_strerror();
 
         emit signalGeneralGIFFinished(gifPath);
-        PBDEB << "AVI生成完毕：" << size << pixmapPaths.size() << interval << compress;
+        PBDEB << "AVI生成完毕：" << size << pixmapPaths.size() << interval << compress << "音频：" << hasAudio << "重复帧：" << dupFrames;
     });
 }
 
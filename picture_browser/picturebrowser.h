@@ -20,11 +20,16 @@
 #include <QFileDialog>
 #include <QMessageBox>
 #include <QtConcurrent/QtConcurrent>
+#include <QThread>
 #include <QProgressBar>
 #include <QInputDialog>
+#include <QImageReader>
+#include <QCryptographicHash>
 #include "gif.h"
+#include "gifdecoder.h"
 #include "ASCII_Art.h"
 #include "avilib.h"
+#include "framepipeline.h"
 
 #define PBDEB qDebug()
 #define BACK_PREV_DIRECTORY ".."
@@ -55,6 +60,15 @@ public:
         QString file;
     };
 
+    struct WavInfo
+    {
+        int channels;
+        int sampleRate;
+        int bits;
+        qint64 dataOffset; // PCM 数据在文件中的位置
+        qint64 dataSize;
+    };
+
 
     void enterDirectory(QString targetDir);
     void readDirectory(QString targetDir);
@@ -201,8 +215,14 @@ private slots:
 
     void on_actionDither_Enabled_triggered();
 
+    void on_actionDither_Ordered_triggered();
+
     void on_actionDither_Disabled_triggered();
 
+    void on_actionGIF_Local_Palette_triggered();
+
+    void on_actionGIF_Global_Palette_triggered();
+
     void on_actionGeneral_AVI_triggered();
 
     void on_actionCreate_To_Origin_Folder_triggered();
@@ -250,14 +270,20 @@ private:
     void commitDeleteCommand();
     void removeUselessItemSelect();
     static QStringList getImageFilters();
+    static bool getBaselineJpegSize(const QByteArray& data, QSize& size);
+    static QImage decodedCanvas(const GifDecoder_H::GifReader& reader);
+    static bool readWavInfo(QFile& file, WavInfo& info);
     bool copyDirectoryFiles(const QString &fromDir, const QString &toDir, bool coverFileIfExist);
     int getRecordInterval();
     void saveImageConversionFlag();
     void fromImageConversionFlag();
 
 signals:
+    void signalGeneralGIFStarted(int frameCount);
     void signalGeneralGIFProgress(int index);
     void signalGeneralGIFFinished(QString path);
+    void signalUnpackGIFFinished(QString dir, int frameCount);
+    void signalGIFOpenFailed(QString path);
 
 private:
     Ui::PictureBrowser *ui;
@@ -284,7 +310,7 @@ private:
     QList<QPair<QString, QString>> deleteCommandsQueue;
 
     int gifBitDepth = 32;
-    bool gifDither = true; // GIF抖动，更加平滑
+    int gifDither = Gif_H::GifDitherFloydSteinberg; // GIF抖动，更加平滑：0 关，1 误差扩散，2 有序（快）
     Qt::ImageConversionFlags imageConversion;
 };
 
@@ -0,0 +1,84 @@
+/**
+ * GifDiffPixels 的 SSE2、AVX2 版本和逐像素比较的版本结果必须完全一致
+ * 覆盖 0~300 个像素（包括不满一组的尾部）和不对齐的起始地址
+ */
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "gif.h"
+
+typedef int (Gif_H::*DiffKernel)(const uint8_t*, const uint8_t*, int, uint8_t*);
+
+// 只比较RGB，不管alpha
+static int referenceDiff(const uint8_t* a, const uint8_t* b, int numPixels, std::vector<uint8_t>& mask)
+{
+    int changed = 0;
+    for (int i = 0; i < numPixels; i++)
+    {
+        if (memcmp(a + i * 4, b + i * 4, 3) != 0)
+        {
+            mask[i >> 3] |= static_cast<uint8_t>(1 << (i & 7));
+            changed++;
+        }
+    }
+    return changed;
+}
+
+int main()
+{
+    Gif_H gif;
+    struct { const char* name; DiffKernel kernel; bool avx2; } kernels[] = {
+        { "scalar", &Gif_H::GifDiffPixelsScalar, false },
+#ifdef GIF_SSE2
+        { "sse2", &Gif_H::GifDiffPixelsSSE2, false },
+#endif
+#ifdef GIF_AVX2
+        { "avx2", &Gif_H::GifDiffPixelsAVX2, true },
+#endif
+        { "dispatch", &Gif_H::GifDiffPixels, false },
+    };
+    const int numKernels = static_cast<int>(sizeof(kernels) / sizeof(kernels[0]));
+    const bool hasAvx2 = gif.GifDetectSimd() >= Gif_H::GifSimdAVX2;
+
+    unsigned seed = 1;
+    int checks = 0, failures = 0;
+    for (int numPixels = 0; numPixels <= 300; numPixels++)
+    {
+        for (int offset = 0; offset < 8; offset++) // 字节偏移，1~3 连像素都不对齐
+        {
+            std::vector<uint8_t> a(numPixels * 4 + 16), b(a.size());
+            for (size_t i = 0; i < a.size(); i++)
+            {
+                seed = seed * 1103515245u + 12345u;
+                a[i] = static_cast<uint8_t>(seed >> 16);
+                // 约三分之一的字节改一位，其中一部分落在alpha上，不应算作变化
+                b[i] = (seed >> 8) % 3 == 0 ? a[i] ^ static_cast<uint8_t>(1 << ((seed >> 4) % 8)) : a[i];
+            }
+            if (numPixels % 3 == 0) // 也要有整段相同的情况
+                b = a;
+
+            std::vector<uint8_t> expected((numPixels + 7) / 8 + 1, 0);
+            const int expectedCount = referenceDiff(a.data() + offset, b.data() + offset, numPixels, expected);
+
+            for (int k = 0; k < numKernels; k++)
+            {
+                if (kernels[k].avx2 && !hasAvx2) // CPU不支持时跳过
+                    continue;
+                std::vector<uint8_t> mask((numPixels + 7) / 8 + 1, 0xAA); // 最后一个字节不能被写到
+                expected.back() = 0xAA;
+                const int count = (gif.*kernels[k].kernel)(a.data() + offset, b.data() + offset, numPixels, mask.data());
+                checks++;
+                if (count != expectedCount || mask != expected)
+                {
+                    failures++;
+                    if (failures <= 10)
+                        printf("FAIL %s: %d pixels, offset %d, %d changed, expected %d\n",
+                               kernels[k].name, numPixels, offset, count, expectedCount);
+                }
+            }
+        }
+    }
+
+    printf("gifdiff_test: simd=%d, %d checks, %d failures\n", gif.GifDetectSimd(), checks, failures);
+    return failures ? 1 : 0;
+}
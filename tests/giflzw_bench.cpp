@@ -0,0 +1,148 @@
+/**
+ * LZW 字典的性能测试：现在的哈希字典（GifLzwDict）和原来 4096×256 的编码树比较
+ * 帧先用 GifQuantizeFrame 转为调色板索引（和录制时一样只有变化的像素不透明），只计LZW压缩的时间
+ * 两种字典写出的码流必须完全相同
+ */
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "gif.h"
+#include "test_frames.h"
+
+// 原来的字典：每个码一个节点，每个节点 256 个子节点
+struct LegacyLzwNode
+{
+    uint16_t next[256];
+};
+
+// 原来的 GifWriteLzwImage 中的压缩循环，写码用现在的 GifWriteCode，只有字典不同
+static void legacyLzwCompress(Gif_H& gif, Gif_H::GifBitStatus& stat, LegacyLzwNode* codetree, const uint8_t* image,
+                              uint32_t width, uint32_t height, int minCodeSize, int& clears)
+{
+    const uint32_t clearCode = 1u << minCodeSize;
+    memset(codetree, 0, sizeof(LegacyLzwNode) * 4096);
+    int32_t curCode = -1;
+    uint32_t codeSize = static_cast<uint32_t>(minCodeSize) + 1;
+    uint32_t maxCode = clearCode + 1;
+
+    gif.GifWriteCode(stat, clearCode, codeSize);
+    for (uint32_t i = 0; i < width * height; i++)
+    {
+        const uint8_t nextValue = image[i * 4 + 3];
+        if (curCode < 0)
+        {
+            curCode = nextValue;
+        }
+        else if (codetree[curCode].next[nextValue])
+        {
+            curCode = codetree[curCode].next[nextValue];
+        }
+        else
+        {
+            gif.GifWriteCode(stat, static_cast<uint32_t>(curCode), codeSize);
+            codetree[curCode].next[nextValue] = static_cast<uint16_t>(++maxCode);
+            if (maxCode >= (1ul << codeSize))
+                codeSize++;
+            if (maxCode == 4095)
+            {
+                gif.GifWriteCode(stat, clearCode, codeSize);
+                memset(codetree, 0, sizeof(LegacyLzwNode) * 4096);
+                clears++;
+                codeSize = static_cast<uint32_t>(minCodeSize + 1);
+                maxCode = clearCode + 1;
+            }
+            curCode = nextValue;
+        }
+    }
+    gif.GifWriteCode(stat, static_cast<uint32_t>(curCode), codeSize);
+    gif.GifWriteCode(stat, clearCode, codeSize);
+    gif.GifWriteCode(stat, clearCode + 1, static_cast<uint32_t>(minCodeSize) + 1);
+    gif.GifFlushCodes(stat);
+}
+
+static double elapsedMs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main()
+{
+    const int width = 1920, height = 1080, rounds = 5;
+    Gif_H gif;
+
+    // 8 帧连续截图和 1 帧噪声，转为调色板索引
+    struct Frame { const char* name; std::vector<uint8_t> indices; int minCodeSize; };
+    std::vector<Frame> frames;
+    {
+        Gif_H::GifWriter writer;
+        if (!gif.GifBegin(&writer, "giflzw_bench.gif", width, height, 10))
+            return 1;
+        for (int i = 0; i <= 8; i++)
+        {
+            std::vector<uint8_t> rgba = i < 8 ? makeScreenFrame(width, height, i) : makeNoiseFrame(width, height, 3);
+            Gif_H::GifPalette pal;
+            gif.GifQuantizeFrame(&writer, rgba.data(), width, height, 8, Gif_H::GifDitherNone, &pal);
+            frames.push_back(Frame{ i < 8 ? "screen" : "noise",
+                                    std::vector<uint8_t>(writer.oldImage, writer.oldImage + rgba.size()),
+                                    pal.bitDepth < 2 ? 2 : pal.bitDepth });
+        }
+        gif.GifEnd(&writer);
+        remove("giflzw_bench.gif");
+    }
+
+    const size_t bound = gif.GifLzwCodesBound(static_cast<size_t>(width) * height);
+    std::vector<uint8_t> legacyCodes(bound), codes(bound);
+    std::vector<LegacyLzwNode> codetree(4096);
+    Gif_H::GifLzwDict* dict = new Gif_H::GifLzwDict;
+
+    int mismatches = 0;
+    double legacyScreen = 0, currentScreen = 0, legacyNoise = 0, currentNoise = 0;
+    int legacyClears = 0, noiseClears = 0;
+    size_t screenBytes = 0;
+    for (size_t f = 0; f < frames.size(); f++)
+    {
+        const bool noise = f == frames.size() - 1;
+        double bestLegacy = 1e9, bestCurrent = 1e9;
+        for (int r = 0; r < rounds; r++)
+        {
+            int clears = 0;
+            Gif_H::GifBitStatus legacy = { 0, 0, legacyCodes.data(), 0 };
+            auto start = std::chrono::steady_clock::now();
+            legacyLzwCompress(gif, legacy, codetree.data(), frames[f].indices.data(), width, height, frames[f].minCodeSize, clears);
+            bestLegacy = std::min(bestLegacy, elapsedMs(start));
+
+            Gif_H::GifBitStatus current = { 0, 0, codes.data(), 0 };
+            start = std::chrono::steady_clock::now();
+            gif.GifLzwCompress(current, dict, frames[f].indices.data(), width, 0, height, width, frames[f].minCodeSize, true, true);
+            bestCurrent = std::min(bestCurrent, elapsedMs(start));
+
+            if (r == 0)
+            {
+                if (legacy.size != current.size || legacy.bitCount != current.bitCount
+                        || memcmp(legacyCodes.data(), codes.data(), current.size) != 0)
+                {
+                    printf("FAIL frame %d: code streams differ\n", static_cast<int>(f));
+                    mismatches++;
+                }
+                (noise ? noiseClears : legacyClears) += clears;
+                if (!noise)
+                    screenBytes += current.size;
+            }
+        }
+        (noise ? legacyNoise : legacyScreen) += bestLegacy;
+        (noise ? currentNoise : currentScreen) += bestCurrent;
+    }
+    delete dict;
+
+    const int screenFrames = static_cast<int>(frames.size()) - 1;
+    printf("giflzw_bench: %dx%d, best of %d rounds, LZW stage only\n", width, height, rounds);
+    printf("  dictionary memory per encode: node table %zu KB, hash dictionary %zu KB\n",
+           sizeof(LegacyLzwNode) * 4096 / 1024, sizeof(Gif_H::GifLzwDict) / 1024);
+    printf("  screen frames: node table %6.2f ms, hash dictionary %6.2f ms per frame (%d clears, %zu KB codes in all)\n",
+           legacyScreen / screenFrames, currentScreen / screenFrames, legacyClears, screenBytes / 1024);
+    printf("  noise frame:   node table %6.2f ms, hash dictionary %6.2f ms (%d clears)\n",
+           legacyNoise, currentNoise, noiseClears);
+    printf("  code streams identical: %s\n", mismatches ? "no" : "yes");
+    return mismatches ? 1 : 0;
+}
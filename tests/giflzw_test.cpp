@@ -0,0 +1,191 @@
+/**
+ * 多线程LZW压缩的往返测试：分段压缩再拼接的码流，用 gifdecoder.h 解码后必须和原图完全一样
+ * 1. 随机图片（1~8位色深、各种宽高），1~8 个线程
+ * 2. 1像素宽的图片在每一行处分成两段：字典的每种大小都会落在接缝上，接缝处清除码的位数最容易出错
+ */
+#include <stdio.h>
+#include <string.h>
+#include <random>
+#include <vector>
+#include "gif.h"
+#include "gifdecoder.h"
+
+static const char* kTestFile = "giflzw_test.gif";
+
+// 每个索引对应不同的颜色，0 是透明色
+static Gif_H::GifPalette makePalette(int bitDepth)
+{
+    Gif_H::GifPalette pal;
+    pal.bitDepth = bitDepth;
+    for (int i = 0; i < 256; i++)
+    {
+        pal.r[i] = static_cast<uint8_t>(i);
+        pal.g[i] = static_cast<uint8_t>(255 - i);
+        pal.b[i] = static_cast<uint8_t>(i ^ 0x55);
+    }
+    return pal;
+}
+
+// 只有逻辑屏幕描述符的文件头，没有全局调色板
+static void writeHeader(FILE* f, uint32_t width, uint32_t height)
+{
+    const uint8_t header[13] = { 'G', 'I', 'F', '8', '9', 'a',
+                                 static_cast<uint8_t>(width), static_cast<uint8_t>(width >> 8),
+                                 static_cast<uint8_t>(height), static_cast<uint8_t>(height >> 8), 0, 0, 0 };
+    fwrite(header, 1, sizeof(header), f);
+}
+
+// 解码 kTestFile 的第一帧，和索引图（alpha中）比较，返回不一致的像素数，-1 表示无法解码
+static long long compareDecoded(const uint8_t* indices, uint32_t width, uint32_t height, const Gif_H::GifPalette& pal)
+{
+    GifDecoder_H decoder;
+    GifDecoder_H::GifReader reader;
+    if (!decoder.GifReadBegin(&reader, kTestFile))
+        return -1;
+    long long bad = -1;
+    if (decoder.GifReadFrame(&reader) && reader.width == width && reader.height == height)
+    {
+        bad = 0;
+        for (size_t i = 0; i < static_cast<size_t>(width) * height; i++)
+        {
+            const int index = indices[i * 4 + 3];
+            const uint8_t* c = reader.canvas + i * 4;
+            const bool same = index == 0 // kGifTransIndex
+                    ? c[3] == 0
+                    : c[0] == pal.r[index] && c[1] == pal.g[index] && c[2] == pal.b[index] && c[3] == 255;
+            if (!same)
+                bad++;
+        }
+    }
+    decoder.GifReadEnd(&reader);
+    return bad;
+}
+
+// 随机图片用 GifWriteLzwImage 在多个线程上压缩
+static int testRandomImages()
+{
+    Gif_H gif;
+    std::mt19937 rng(7);
+    int runs = 0, failures = 0;
+    for (int it = 0; it < 200; it++)
+    {
+        const int bitDepth = 1 + static_cast<int>(rng() % 8);
+        const int threads = 1 + it % 8;
+        const uint32_t width = 1 + rng() % 700;
+        // 每段至少 64K 像素才会分段，让大部分图片都能分成 threads 段
+        uint32_t height = (65536u * static_cast<uint32_t>(threads) + rng() % 100000) / width + 1;
+        if (height > 65535)
+            height = 65535;
+
+        // 随机、长短不一的重复、大部分有规律，压缩率各不相同
+        const int mode = static_cast<int>(rng() % 3);
+        const uint32_t numColors = 1u << bitDepth;
+        std::vector<uint8_t> image(static_cast<size_t>(width) * height * 4);
+        for (size_t i = 0; i < static_cast<size_t>(width) * height; i++)
+        {
+            uint32_t v;
+            if (mode == 0)
+                v = rng() % numColors;
+            else if (mode == 1)
+                v = static_cast<uint32_t>(i / (1 + rng() % 50)) % numColors;
+            else
+                v = rng() % 16 == 0 ? rng() % numColors : static_cast<uint32_t>(i % numColors);
+            image[i * 4 + 3] = static_cast<uint8_t>(v);
+        }
+
+        Gif_H::GifPalette pal = makePalette(bitDepth);
+        FILE* f = fopen(kTestFile, "wb");
+        if (!f)
+            return 1;
+        writeHeader(f, width, height);
+        gif.GifWriteLzwImage(f, image.data(), 0, 0, width, height, 0, &pal, 0, true, threads);
+        fputc(0x3b, f);
+        fclose(f);
+
+        const long long bad = compareDecoded(image.data(), width, height, pal);
+        runs++;
+        if (bad != 0)
+        {
+            failures++;
+            if (failures <= 10)
+                printf("FAIL random %ux%u, %d bits, %d threads, mode %d: %lld pixels differ\n",
+                       width, height, bitDepth, threads, mode, bad);
+        }
+    }
+    printf("giflzw_test: %d random images on 1-8 threads, %d failures\n", runs, failures);
+    return failures;
+}
+
+// 1像素宽的图片在第 k 行分成两段，分别压缩后拼接
+static int testEverySeam()
+{
+    Gif_H gif;
+    const uint32_t width = 1, height = 5000; // 8位色深时字典会在中间填满一次
+    unsigned seed = 5;
+    int runs = 0, failures = 0;
+    Gif_H::GifLzwDict* dict = new Gif_H::GifLzwDict;
+    for (int bitDepth = 8; bitDepth >= 2; bitDepth -= 2)
+    {
+        Gif_H::GifPalette pal = makePalette(bitDepth);
+        std::vector<uint8_t> image(static_cast<size_t>(width) * height * 4);
+        for (uint32_t i = 0; i < height; i++)
+        {
+            seed = seed * 1103515245u + 12345u;
+            image[i * 4 + 3] = static_cast<uint8_t>((seed >> 16) % (1u << bitDepth));
+        }
+
+        std::vector<uint8_t> first(gif.GifLzwCodesBound(height) + 16), second(first.size());
+        std::vector<uint8_t> out(gif.GifLzwImageBound(width, height));
+        for (uint32_t k = 1; k < height; k++)
+        {
+            Gif_H::GifBitStatus a = { 0, 0, first.data(), 0 };
+            Gif_H::GifBitStatus b = { 0, 0, second.data(), 0 };
+            gif.GifLzwCompress(a, dict, image.data(), width, 0, k, width, bitDepth, true, false);
+            gif.GifLzwCompress(b, dict, image.data(), width, k, height, width, bitDepth, false, true);
+            gif.GifAppendCodes(a, b);
+            Gif_H::GifBuffer codes = { out.data(), 0, out.size() };
+            gif.GifFinishCodes(codes, a);
+
+            FILE* f = fopen(kTestFile, "wb");
+            if (!f)
+                return 1;
+            writeHeader(f, width, height);
+            const uint8_t control[8] = { 0x21, 0xf9, 0x04, 0x05, 0, 0, 0, 0 }; // 和 GifEncodeLzwImage 一样，索引0透明
+            fwrite(control, 1, sizeof(control), f);
+            const uint8_t descriptor[10] = { 0x2c, 0, 0, 0, 0, static_cast<uint8_t>(width), static_cast<uint8_t>(width >> 8),
+                                             static_cast<uint8_t>(height), static_cast<uint8_t>(height >> 8),
+                                             static_cast<uint8_t>(0x80 | (bitDepth - 1)) };
+            fwrite(descriptor, 1, sizeof(descriptor), f);
+            for (int i = 0; i < (1 << bitDepth); i++)
+            {
+                fputc(pal.r[i], f);
+                fputc(pal.g[i], f);
+                fputc(pal.b[i], f);
+            }
+            fputc(bitDepth, f);
+            fwrite(codes.data, 1, codes.size, f);
+            fputc(0, f);
+            fputc(0x3b, f);
+            fclose(f);
+
+            const long long bad = compareDecoded(image.data(), width, height, pal);
+            runs++;
+            if (bad != 0)
+            {
+                failures++;
+                if (failures <= 10)
+                    printf("FAIL seam at row %u, %d bits: %lld pixels differ\n", k, bitDepth, bad);
+            }
+        }
+    }
+    delete dict;
+    printf("giflzw_test: %d seams of a 1-pixel-wide image, %d failures\n", runs, failures);
+    return failures;
+}
+
+int main()
+{
+    const int failures = testRandomImages() + testEverySeam();
+    remove(kTestFile);
+    return failures ? 1 : 0;
+}
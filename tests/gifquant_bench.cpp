@@ -0,0 +1,96 @@
+/**
+ * 调色板生成方式的性能测试：原来的 median split 和颜色直方图（全部像素、抽样）
+ * 分别统计生成调色板的时间、整帧写入的时间，
+ * 再用 gifdecoder.h 解码写出的GIF，计算和原图的PSNR
+ */
+#include <math.h>
+#include <stdio.h>
+#include <chrono>
+#include <vector>
+#include "gif.h"
+#include "gifdecoder.h"
+#include "test_frames.h"
+
+static double elapsedMs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main()
+{
+    const int width = 1920, height = 1080, numFrames = 8, rounds = 3;
+    std::vector<std::vector<uint8_t>> frames;
+    for (int i = 0; i < numFrames; i++)
+        frames.push_back(i % 4 == 3 ? makePhotoFrame(width, height, i) : makeScreenFrame(width, height, i));
+
+    const struct { const char* name; Gif_H::GifQuantizer quantizer; } quantizers[] = {
+        { "median split", Gif_H::GifQuantizeMedianSplit },
+        { "histogram", Gif_H::GifQuantizeHistogram },
+        { "histogram/4", Gif_H::GifQuantizeHistogramSampled },
+    };
+
+    printf("gifquant_bench: %d frames of %dx%d\n", numFrames, width, height);
+    printf("  %-13s %-7s %10s %10s %9s\n", "quantizer", "dither", "palette", "frame", "PSNR");
+    int failures = 0;
+    for (const auto& q : quantizers)
+    {
+        for (int dither = 0; dither < 2; dither++)
+        {
+            Gif_H gif;
+
+            // 只生成调色板，每帧都从整帧生成
+            double paletteMs = 1e9;
+            for (int r = 0; r < rounds; r++)
+            {
+                Gif_H::GifPalette pal;
+                auto start = std::chrono::steady_clock::now();
+                for (int i = 0; i < numFrames; i++)
+                    gif.GifMakePalette(nullptr, frames[i].data(), width, height, 8, dither != 0, &pal, nullptr, q.quantizer);
+                paletteMs = std::min(paletteMs, elapsedMs(start) / numFrames);
+            }
+
+            // 写入完整的GIF
+            Gif_H::GifWriter writer;
+            if (!gif.GifBegin(&writer, "gifquant_bench.gif", width, height, 10))
+                return 1;
+            writer.quantizer = q.quantizer;
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < numFrames; i++)
+                gif.GifWriteFrame(&writer, frames[i].data(), width, height, 10, 8, dither ? Gif_H::GifDitherFloydSteinberg : Gif_H::GifDitherNone);
+            const double frameMs = elapsedMs(start) / numFrames;
+            gif.GifEnd(&writer);
+
+            // 解码后和原图比较
+            GifDecoder_H decoder;
+            GifDecoder_H::GifReader reader;
+            double squaredError = 0;
+            int decoded = 0;
+            if (decoder.GifReadBegin(&reader, "gifquant_bench.gif"))
+            {
+                while (decoded < numFrames && decoder.GifReadFrame(&reader))
+                {
+                    const std::vector<uint8_t>& source = frames[decoded++];
+                    for (size_t k = 0; k < source.size(); k++)
+                    {
+                        if (k % 4 == 3)
+                            continue;
+                        const double e = static_cast<double>(reader.canvas[k]) - source[k];
+                        squaredError += e * e;
+                    }
+                }
+                decoder.GifReadEnd(&reader);
+            }
+            remove("gifquant_bench.gif");
+            if (decoded != numFrames)
+            {
+                printf("FAIL %s: decoded %d of %d frames\n", q.name, decoded, numFrames);
+                failures++;
+                continue;
+            }
+            const double mse = squaredError / (static_cast<double>(numFrames) * width * height * 3);
+            printf("  %-13s %-7s %7.1f ms %7.1f ms %6.2f dB\n", q.name, dither ? "yes" : "no",
+                   paletteMs, frameMs, 10 * log10(255.0 * 255.0 / mse));
+        }
+    }
+    return failures ? 1 : 0;
+}
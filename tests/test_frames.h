@@ -0,0 +1,99 @@
+#ifndef TEST_FRAMES_H
+#define TEST_FRAMES_H
+
+/**
+ * 测试和性能测试用的合成截图，RGBA
+ * 大部分是界面：标题栏、纯色背景、一行行文字、按钮，加上一块渐变的“图片”；
+ * 每帧文字滚动一点、鼠标移动一点，和连续截图相近
+ */
+#include <stdint.h>
+#include <vector>
+
+inline std::vector<uint8_t> makeScreenFrame(int width, int height, int frame)
+{
+    std::vector<uint8_t> image(static_cast<size_t>(width) * height * 4);
+    const int photoLeft = width * 3 / 5, photoTop = height / 6;
+    const int photoRight = width - 40, photoBottom = height * 2 / 3;
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            uint8_t* p = &image[(static_cast<size_t>(y) * width + x) * 4];
+            int r = 243, g = 243, b = 245; // 背景
+            if (y < 32) // 标题栏
+            {
+                r = 45; g = 90; b = 160;
+            }
+            else if (x < 220) // 侧边栏
+            {
+                r = 230; g = 232; b = 236;
+                if ((y - 40) % 36 < 28 && (y - 40) / 36 == (frame / 8) % 12) // 选中的一项
+                {
+                    r = 200; g = 220; b = 250;
+                }
+            }
+            else if (x >= photoLeft && x < photoRight && y >= photoTop && y < photoBottom) // 图片
+            {
+                r = (x - photoLeft) * 255 / (photoRight - photoLeft);
+                g = (y - photoTop) * 255 / (photoBottom - photoTop);
+                b = ((x + y) * 3 + (x * y >> 7)) & 255;
+            }
+            else // 文字：每行 18 像素高，字形用位运算代替，随帧滚动
+            {
+                const int line = (y + frame * 2) / 18, row = (y + frame * 2) % 18;
+                const int glyph = (x - 230) / 9, col = (x - 230) % 9;
+                const int lineLength = 20 + (line * 37) % 90;
+                if (x >= 230 && glyph < lineLength && row >= 3 && row < 15 && col < 7
+                        && ((line * 131 + glyph * 71 + row * col + (row ^ col)) % 5 < 2))
+                {
+                    r = 30; g = 30; b = (line % 7 == 0) ? 200 : 30; // 偶尔有蓝色的链接
+                }
+            }
+            // 鼠标
+            const int cursorX = 400 + frame * 7 % (width - 500), cursorY = 300 + frame * 5 % (height - 400);
+            if (x >= cursorX && y >= cursorY && x - cursorX < 12 && y - cursorY < 18 && x - cursorX <= (y - cursorY) * 2 / 3)
+            {
+                r = 0; g = 0; b = 0;
+            }
+            p[0] = static_cast<uint8_t>(r);
+            p[1] = static_cast<uint8_t>(g);
+            p[2] = static_cast<uint8_t>(b);
+            p[3] = 255;
+        }
+    }
+    return image;
+}
+
+// 照片一样颜色平滑过渡的帧，调色板的好坏主要看这种画面
+inline std::vector<uint8_t> makePhotoFrame(int width, int height, int frame)
+{
+    std::vector<uint8_t> image(static_cast<size_t>(width) * height * 4);
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            uint8_t* p = &image[(static_cast<size_t>(y) * width + x) * 4];
+            const int dx = x - width / 2 - frame * 9, dy = y - height / 2;
+            const int sky = y * 255 / height;
+            p[0] = static_cast<uint8_t>((sky / 2 + (x * 180 / width)) & 255);
+            p[1] = static_cast<uint8_t>(120 + (dx * dx + dy * dy) / (width * 4) % 120);
+            p[2] = static_cast<uint8_t>(255 - sky + ((x ^ y) & 7));
+            p[3] = 255;
+        }
+    }
+    return image;
+}
+
+// 没有任何规律的帧，LZW 字典最常被填满
+inline std::vector<uint8_t> makeNoiseFrame(int width, int height, unsigned seed)
+{
+    std::vector<uint8_t> image(static_cast<size_t>(width) * height * 4);
+    for (size_t i = 0; i < image.size(); i++)
+    {
+        seed = seed * 1103515245u + 12345u;
+        image[i] = static_cast<uint8_t>(seed >> 16);
+    }
+    return image;
+}
+
+#endif // TEST_FRAMES_H